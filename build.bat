@@ -1,7 +1,7 @@
 make mingw
 rd /S /Q output
 md output
-robocopy src output *.exe *.dll
+robocopy src output *.exe *.dll /XF bootluac.exe
 robocopy . output COPYRIGHT HISTORY INSTALL README README.md
 rename output\lua.exe esolua.exe
 rename output\luac.exe esoluac.exe
\ No newline at end of file
@@ -0,0 +1,260 @@
+#define ESO_CACHE_DEFAULTPATH "esolua_cache"
+#define ESO_CACHE_MAGIC "ESOLUAC"
+#define ESO_CACHE_VERSION 4 // bump whenever the code generator changes
+
+// header in front of the dumped chunk; a hit requires all fields to match
+typedef struct eso_CacheHeader {
+  char magic[sizeof(ESO_CACHE_MAGIC)];
+  unsigned int version;
+  unsigned long long mtime;
+  unsigned long long size;
+  unsigned long long hash;
+} eso_CacheHeader;
+
+typedef struct eso_Buffer {
+  char *data;
+  size_t size;
+  size_t capacity;
+} eso_Buffer;
+
+static char *eso_cachepath = NULL;
+static bool eso_cacheenabled = true;
+
+LUA_API void eso_set_cache_path(const char *path) {
+  free(eso_cachepath);
+  eso_cachepath = NULL;
+  eso_cacheenabled = (path != NULL);
+  if (path != NULL) {
+    eso_cachepath = strdup(path);
+  }
+}
+
+static const char *eso_getcachepath() {
+  if (!eso_cacheenabled) {
+    return NULL;
+  }
+  return eso_cachepath != NULL ? eso_cachepath : ESO_CACHE_DEFAULTPATH;
+}
+
+// 64-bit FNV-1a, used for the cache file name and the content check
+static unsigned long long eso_hash(const char *data, size_t size) {
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= (unsigned char)data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static bool eso_readfile(const char *path, eso_Buffer *buffer) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return false;
+  }
+
+  buffer->size = 0;
+  size_t read;
+  do {
+    if (buffer->capacity - buffer->size < LUAL_BUFFERSIZE) {
+      size_t capacity = buffer->capacity * 2 + LUAL_BUFFERSIZE;
+      char *data = realloc(buffer->data, capacity);
+      if (data == NULL) {
+        fclose(fp);
+        return false;
+      }
+      buffer->data = data;
+      buffer->capacity = capacity;
+    }
+    read = fread(buffer->data + buffer->size, 1,
+                 buffer->capacity - buffer->size, fp);
+    buffer->size += read;
+  } while (read > 0);
+
+  bool success = !ferror(fp);
+  fclose(fp);
+  return success;
+}
+
+static int eso_bufferwriter(lua_State *L, const void *p, size_t size,
+                            void *ud) {
+  eso_Buffer *buffer = (eso_Buffer *)ud;
+  (void)L;
+  if (buffer->capacity - buffer->size < size) {
+    size_t capacity = buffer->capacity * 2 + size;
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+      return 1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->size, p, size);
+  buffer->size += size;
+  return 0;
+}
+
+static void eso_makecachedir(const char *path) {
+#if defined(_WIN32)
+  mkdir(path);
+#else
+  mkdir(path, 0755);
+#endif
+}
+
+static char *eso_getcachefilename(const char *filePath) {
+  const char *cachePath = eso_getcachepath();
+  if (cachePath == NULL) {
+    return NULL;
+  }
+
+  char *result = malloc(strlen(cachePath) + 1 + 16 + sizeof(".luac"));
+  if (result != NULL) {
+    sprintf(result, "%s/%016llx.luac", cachePath,
+            eso_hash(filePath, strlen(filePath)));
+  }
+  return result;
+}
+
+static void eso_fillcacheheader(eso_CacheHeader *header, const char *filePath,
+                                const eso_Buffer *source) {
+  struct stat info;
+  memset(header, 0, sizeof(eso_CacheHeader));
+  memcpy(header->magic, ESO_CACHE_MAGIC, sizeof(ESO_CACHE_MAGIC));
+  header->version = ESO_CACHE_VERSION;
+  if (stat(filePath, &info) == 0) {
+    header->mtime = (unsigned long long)info.st_mtime;
+  }
+  header->size = source->size;
+  header->hash = eso_hash(source->data, source->size);
+}
+
+// loads the cached chunk when it belongs to the exact same source
+static bool eso_tryloadcachedchunk(lua_State *L, const char *cacheFile,
+                                   const eso_CacheHeader *expected,
+                                   const char *chunkName) {
+  eso_Buffer cached = {NULL, 0, 0};
+  bool success = false;
+  if (eso_readfile(cacheFile, &cached) &&
+      cached.size > sizeof(eso_CacheHeader) &&
+      memcmp(cached.data, expected, sizeof(eso_CacheHeader)) == 0) {
+    if (luaL_loadbuffer(L, cached.data + sizeof(eso_CacheHeader),
+                        cached.size - sizeof(eso_CacheHeader),
+                        chunkName) == 0) {
+      success = true;
+    } else {
+      eso_log("failed to load cached chunk '%s': %s", cacheFile,
+              lua_tostring(L, -1));
+      lua_pop(L, 1);
+    }
+  }
+  free(cached.data);
+  return success;
+}
+
+// the chunk keeps its source name and line info, so errors read the same
+// whether it came from the cache or not, at the cost of larger cache files
+static void eso_writecachedchunk(lua_State *L, const char *cacheFile,
+                                 const eso_CacheHeader *header) {
+  eso_Buffer dump = {NULL, 0, 0};
+  const Closure *cl = (const Closure *)lua_topointer(L, -1);
+  if (eso_bufferwriter(L, header, sizeof(eso_CacheHeader), &dump) != 0 ||
+      luaU_dump(L, cl->l.p, eso_bufferwriter, &dump, 0) != 0) {
+    free(dump.data);
+    return;
+  }
+
+  eso_makecachedir(eso_getcachepath());
+
+  // write to a private file first, so concurrent runs never see partial data
+  char tempFile[strlen(cacheFile) + 32];
+  sprintf(tempFile, "%s.%ld.tmp", cacheFile, (long)getpid());
+  FILE *fp = fopen(tempFile, "wb");
+  if (fp == NULL) {
+    eso_log("failed to write cache file '%s'", tempFile);
+    free(dump.data);
+    return;
+  }
+
+  bool success = fwrite(dump.data, 1, dump.size, fp) == dump.size;
+  success = (fclose(fp) == 0) && success;
+#if defined(_WIN32)
+  remove(cacheFile);
+#endif
+  if (!success || rename(tempFile, cacheFile) != 0) {
+    remove(tempFile);
+  }
+  free(dump.data);
+}
+
+// skips the UTF-8 BOM and a '#' first line the same way luaL_loadfile does
+static const char *eso_skipsourceprefix(const eso_Buffer *source,
+                                        size_t *size) {
+  const char *data = source->data;
+  const char *end = source->data + source->size;
+  if (end - data >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0) {
+    data += 3;
+  }
+  if (data < end && *data == '#') {
+    // keep the newline so line numbers stay intact
+    while (data < end && *data != '\n') {
+      data++;
+    }
+  }
+  *size = end - data;
+  return data;
+}
+
+// loads a Lua file through the bytecode cache; behaves like luaL_loadfile and
+// fills in the read and parse fields of the record when one is passed
+static int eso_loadluafile(lua_State *L, const char *filePath,
+                           eso_LoadRecord *record) {
+  eso_Buffer source = {NULL, 0, 0};
+  lua_pushfstring(L, "@%s", filePath);
+  const char *chunkName = lua_tostring(L, -1);
+
+  double start = eso_getclock();
+  if (!eso_readfile(filePath, &source)) {
+    free(source.data);
+    lua_pushfstring(L, "cannot read %s", filePath);
+    lua_remove(L, -2);
+    return LUA_ERRFILE;
+  }
+
+  double parseStart = eso_getclock();
+  size_t allocated = eso_getallocatedbytes(L);
+  if (record != NULL) {
+    record->size = source.size;
+    record->readTime = parseStart - start;
+  }
+
+  int status = 0;
+  eso_CacheHeader header;
+  char *cacheFile = eso_getcachefilename(filePath);
+  if (cacheFile != NULL) {
+    eso_fillcacheheader(&header, filePath, &source);
+  }
+  if (cacheFile != NULL &&
+      eso_tryloadcachedchunk(L, cacheFile, &header, chunkName)) {
+    eso_log("loaded '%s' from cache", filePath);
+    if (record != NULL) {
+      record->cached = true;
+    }
+  } else {
+    size_t size;
+    const char *data = eso_skipsourceprefix(&source, &size);
+    status = luaL_loadbuffer(L, data, size, chunkName);
+    if (status == 0 && cacheFile != NULL) {
+      eso_writecachedchunk(L, cacheFile, &header);
+    }
+  }
+
+  if (record != NULL) {
+    record->parseTime = eso_getclock() - parseStart;
+    record->parseBytes = eso_getallocatedbytes(L) - allocated;
+  }
+
+  free(cacheFile);
+  free(source.data);
+  lua_remove(L, -2);
+  return status;
+}
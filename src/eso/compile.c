@@ -0,0 +1,189 @@
+// the files of an addon are compiled on worker threads, each with its own
+// scratch state producing a dump; the main state only undumps and runs them in
+// manifest order, starting as soon as the next file in line is ready
+
+#if defined(LUA_USE_THREADS)
+#include <pthread.h>
+#endif
+
+#define ESO_COMPILE_MAXTHREADS 16
+
+typedef struct eso_CompileJob {
+  const char *path;
+  eso_Buffer dump;
+  eso_LoadRecord record;
+  char *error;
+  bool done;
+} eso_CompileJob;
+
+typedef struct eso_CompileQueue {
+  eso_CompileJob *jobs;
+  int count;
+  int next;
+#if defined(LUA_USE_THREADS)
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+#endif
+} eso_CompileQueue;
+
+#if defined(LUA_USE_THREADS)
+
+static void eso_compilejob(lua_State *L, eso_CompileJob *job) {
+  if (L == NULL) {
+    job->error = strdup("not enough memory");
+    return;
+  }
+
+  if (eso_loadluafile(L, job->path, &job->record) != 0) {
+    job->error = strdup(lua_tostring(L, -1));
+  } else {
+    const Closure *cl = (const Closure *)lua_topointer(L, -1);
+    if (luaU_dump(L, cl->l.p, eso_bufferwriter, &job->dump, 0) != 0) {
+      job->error = strdup("not enough memory");
+    }
+  }
+  lua_settop(L, 0);
+}
+
+static void *eso_compileworker(void *ud) {
+  eso_CompileQueue *queue = (eso_CompileQueue *)ud;
+  eso_AllocCounter counter;
+  lua_State *L = luaL_newstate();
+  if (L != NULL) {
+    eso_countallocations(L, &counter);
+  }
+  for (;;) {
+    pthread_mutex_lock(&queue->lock);
+    int index = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (index >= queue->count) {
+      break;
+    }
+
+    eso_CompileJob *job = &queue->jobs[index];
+    eso_compilejob(L, job);
+
+    pthread_mutex_lock(&queue->lock);
+    job->done = true;
+    pthread_cond_broadcast(&queue->done);
+    pthread_mutex_unlock(&queue->lock);
+  }
+
+  if (L != NULL) {
+    lua_close(L);
+  }
+  return NULL;
+}
+
+static int eso_getcompilethreadcount(int count) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) {
+    cpus = 1;
+  }
+  if (cpus > ESO_COMPILE_MAXTHREADS) {
+    cpus = ESO_COMPILE_MAXTHREADS;
+  }
+  return count < cpus ? count : (int)cpus;
+}
+
+static bool eso_compileandrun(lua_State *L, const char *const *paths,
+                              int count, bool *success) {
+  int threadCount = eso_getcompilethreadcount(count);
+  if (threadCount < 2) {
+    return false;
+  }
+
+  eso_CompileQueue queue;
+  queue.jobs = calloc(count, sizeof(eso_CompileJob));
+  if (queue.jobs == NULL) {
+    return false;
+  }
+  queue.count = count;
+  queue.next = 0;
+  for (int i = 0; i < count; ++i) {
+    queue.jobs[i].path = paths[i];
+  }
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.done, NULL);
+
+  pthread_t threads[ESO_COMPILE_MAXTHREADS];
+  int started = 0;
+  while (started < threadCount &&
+         pthread_create(&threads[started], NULL, eso_compileworker, &queue) ==
+             0) {
+    started++;
+  }
+  eso_log("compiling %d files on %d threads", count, started);
+
+  for (int i = 0; i < count; ++i) {
+    eso_CompileJob *job = &queue.jobs[i];
+    if (started == 0) { // no worker could be started, so do it right here
+      *success = eso_tryloadluafile(L, job->path) && *success;
+      continue;
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    while (!job->done) {
+      pthread_cond_wait(&queue.done, &queue.lock);
+    }
+    pthread_mutex_unlock(&queue.lock);
+
+    eso_log("try load Lua file '%s'", job->path);
+    eso_LoadRecord *record = &job->record;
+    record->path = strdup(job->path);
+    double start = eso_getclock();
+    size_t allocated = eso_getallocatedbytes(L);
+    if (job->error != NULL) {
+      *success = false;
+      eso_addloadrecord(record);
+      eso_log("%s", job->error);
+    } else if (luaL_loadbuffer(L, job->dump.data, job->dump.size,
+                               job->path) != 0) {
+      *success = false;
+      eso_addloadrecord(record);
+      eso_log("%s", lua_tostring(L, -1));
+      lua_pop(L, 1);
+    } else {
+      // undumping in the main state counts as part of parsing
+      record->parseTime += eso_getclock() - start;
+      record->parseBytes += eso_getallocatedbytes(L) - allocated;
+      *success = eso_tryrunluachunk(L, record) && *success;
+    }
+    free(job->dump.data);
+    free(job->error);
+  }
+
+  for (int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_cond_destroy(&queue.done);
+  pthread_mutex_destroy(&queue.lock);
+  free(queue.jobs);
+  return true;
+}
+
+#else
+
+static bool eso_compileandrun(lua_State *L, const char *const *paths,
+                              int count, bool *success) {
+  (void)L;
+  (void)paths;
+  (void)count;
+  (void)success;
+  return false;
+}
+
+#endif
+
+// loads and runs the files in order, compiling them in parallel if possible;
+// returns false if any of them failed
+static bool eso_loadluafiles(lua_State *L, const char *const *paths,
+                             int count) {
+  bool success = true;
+  if (!eso_compileandrun(L, paths, count, &success)) {
+    for (int i = 0; i < count; ++i) {
+      success = eso_tryloadluafile(L, paths[i]) && success;
+    }
+  }
+  return success;
+}
@@ -65,10 +65,7 @@ function eso.SetString(prefix, id, value)
 end
 
 -- for time.lua
-local frameTimeMilliseconds = 0
 function GetTimeStamp() return math.floor(GetGameTimeMilliseconds() / 1000) end
-function GetFrameTimeMilliseconds() return frameTimeMilliseconds end
-function GetFrameTimeSeconds() return frameTimeMilliseconds / 1000 end
 function GetGameTimeSeconds() return GetGameTimeMilliseconds() / 1000 end 
 function FormatTimeSeconds() return "replace me", 0.5 end
 
@@ -94,105 +91,20 @@ function GetWindowManager() return {} end
 function GetAnimationManager() return {} end
 
 do
-    local EVENT_MANAGER = {}
-
-    local events = {}
-    function EVENT_MANAGER:RegisterForEvent(namespace, event, callback)
-        if type(namespace) ~= "string" or not event or not callback or (events[event] and events[event][namespace]) then
-            return false
-        end
-
-        events[event] = events[event] or {}
-        events[event][namespace] = callback
-        return true
-    end
-
-    function EVENT_MANAGER:AddFilterForEvent(namespace, ...)
-        return false
-    end
-
-    function EVENT_MANAGER:UnregisterForEvent(namespace, event)
-        if type(namespace) == "string" and event and events[event] and events[event][namespace] then
-            events[event][namespace] = nil
-            return true
-        end
-
-        return false
-    end
-
-    local pendingEvents = {}
-    function eso.TriggerEvent(event, ...)
-        if events[event] then
-            for _, callback in pairs(events[event]) do
-                pendingEvents[#pendingEvents + 1] = { callback = callback, args = {event, ...} }
-            end
-        end
-    end
-
-    local updates = {}
-    function EVENT_MANAGER:RegisterForUpdate(namespace, interval, callback)
-        Log("Register for update " .. namespace .. " with interval " .. interval)
-        if updates[namespace] then
-            Log("Already registered")
-            return false
-        end
-        updates[namespace] = { interval = interval, callback = callback, updateTime = GetGameTimeMilliseconds() + interval }
-        return true
-    end
-
-    function EVENT_MANAGER:UnregisterForUpdate(namespace)
-        Log("Unregister for update " .. namespace)
-        if not updates[namespace] then
-            Log("Not registered")
-            return false
-        end
-        updates[namespace] = nil
-        return true
-    end
+    local EVENT_MANAGER = eso.EventManager
 
     local FRAME_RATE_MS = 1000 / 60
     function eso.HandleNextFrame()
-        frameTimeMilliseconds = GetGameTimeMilliseconds()
-
-        if #pendingEvents > 0 then
-            Log("Run " .. #pendingEvents .. " pending event handlers")
-            for _, event in pairs(pendingEvents) do
-                local success, err = pcall(event.callback, unpack(event.args))
-                if not success then
-                    print("Error in event handler: " .. err)
-                end
-            end
-            pendingEvents = {}
-        end
-
-        local pendingUpdates = {}
-        for _, entry in pairs(updates) do
-            if entry.updateTime <= frameTimeMilliseconds then
-                pendingUpdates[#pendingUpdates + 1] = entry
-            end
-        end
-
-        if #pendingUpdates > 0 then
-            Log("Run " .. #pendingUpdates .. " pending updates")
-            for _, entry in pairs(pendingUpdates) do
-                entry.callback()
-                entry.updateTime = GetGameTimeMilliseconds() + entry.interval
-            end
-        end
-
-        local futureUpdateCount = 0
-        local closestUpdateTime = math.huge
-        for _, entry in pairs(updates) do
-            if entry.updateTime > frameTimeMilliseconds then
-                closestUpdateTime = math.min(closestUpdateTime, entry.updateTime)
-                futureUpdateCount = futureUpdateCount + 1
-            end
-        end
-
-        if futureUpdateCount > 0 or #pendingEvents > 0 then
-            Log("Waiting for " .. futureUpdateCount .. " updates and " .. #pendingEvents .. " events")
-            if futureUpdateCount > 0 then
-                local framesToWait = math.ceil((closestUpdateTime - frameTimeMilliseconds) / FRAME_RATE_MS)
+        eso.RunFrame()
+        local frameTimeMilliseconds = GetFrameTimeMilliseconds()
+        local closestUpdateTime, updateCount = eso.GetNextUpdateTime()
+
+        local pendingEventCount = eso.GetNumPendingEvents()
+        local pendingTaskCount = eso.GetNumPendingTasks()
+        if updateCount > 0 or pendingEventCount > 0 or pendingTaskCount > 0 then
+            Log("Waiting for " .. updateCount .. " updates, " .. pendingEventCount .. " events and " .. pendingTaskCount .. " tasks")
+            if updateCount > 0 and pendingTaskCount == 0 then
+                local framesToWait = math.max(1, math.ceil((closestUpdateTime - frameTimeMilliseconds) / FRAME_RATE_MS))
                 local timeToWait = framesToWait * FRAME_RATE_MS
                 Log(string.format("Next update in %.0fms, skipping %d frames", timeToWait, framesToWait - 1))
                 eso.Sleep(timeToWait)
@@ -206,9 +118,10 @@ do
     end
 
     function eso.ClearAllEventsAndUpdates()
-        Log("Removing all pending events and updates")
-        updates = {}
-        pendingEvents = {}
+        Log("Removing all pending events, updates and tasks")
+        eso.ClearUpdates()
+        eso.ClearPendingEvents()
+        eso.ClearTasks()
     end
 
     function GetEventManager() return EVENT_MANAGER end
@@ -244,6 +157,14 @@ DIALOGUE_TONE_TYPE_MERCIFUL = 5
 DIALOGUE_TONE_TYPE_RUTHLESS = 6
 
 local function tryLoadIngameSource()
+    if ESOUI_LAZY then
+        local files = {}
+        for i, file in ipairs(filesToLoad) do
+            files[i] = ESOUI_SOURCE_PATH .. file
+        end
+        return eso.LoadLuaFilesLazily(files)
+    end
+
     for _, file in ipairs(filesToLoad) do
         if not eso.LoadLuaFile(ESOUI_SOURCE_PATH .. file, true) then
             return false
@@ -261,4 +182,5 @@ else
 end
 
 ESOUI_SOURCE_PATH = nil
-ESOUI_DEBUG = nil
\ No newline at end of file
+ESOUI_DEBUG = nil
+ESOUI_LAZY = nil
\ No newline at end of file
@@ -0,0 +1,786 @@
+#define ESO_EVENTS_INDEX "eso.events"            // event -> slot
+#define ESO_EVENTS_NAMESPACES "eso.events.names" // slot -> namespace -> index
+
+// handlers are kept in one dense array per event in registration order;
+// unregistering only leaves a tombstone, which is removed after dispatching
+// so the arrays never change while they are being iterated
+//
+// triggered events go into one of two queues: while one is dispatched,
+// handlers trigger into the other one, which is dispatched on the next frame;
+// the arguments are kept on dedicated thread stacks, so queueing an event
+// does not create any garbage
+//
+// filters are compiled into small match structures when they are added and
+// tested in C; an event that no handler accepts is not queued at all
+//
+// a queued event goes to the handlers that were registered when it was
+// triggered and are still registered when it is dispatched; each handler
+// has a generation in registration order, which the event compares with the
+// generation of its list at the time it was triggered
+
+// the argument positions count from the first argument after the event code
+// and are those of the event the filter is usually used with; they can be
+// changed per event with eso.SetEventFilterArgument
+static const struct {
+  const char *name;
+  bool prefix;
+  unsigned char argument;
+} eso_filtertypes[] = {{"REGISTER_FILTER_UNIT_TAG", false, 1},
+                       {"REGISTER_FILTER_UNIT_TAG_PREFIX", true, 1},
+                       {"REGISTER_FILTER_COMBAT_RESULT", false, 1},
+                       {"REGISTER_FILTER_IS_ERROR", false, 2},
+                       {"REGISTER_FILTER_SOURCE_COMBAT_UNIT_TYPE", false, 7},
+                       {"REGISTER_FILTER_TARGET_COMBAT_UNIT_TYPE", false, 9},
+                       {"REGISTER_FILTER_POWER_TYPE", false, 11},
+                       {"REGISTER_FILTER_DAMAGE_TYPE", false, 12},
+                       {"REGISTER_FILTER_ABILITY_ID", false, 16},
+                       {"REGISTER_FILTER_BAG_ID", false, 1},
+                       {"REGISTER_FILTER_IS_NEW_ITEM", false, 3},
+                       {"REGISTER_FILTER_INVENTORY_UPDATE_REASON", false, 5}};
+
+#define ESO_FILTER_TYPES                                                       \
+  ((int)(sizeof(eso_filtertypes) / sizeof(eso_filtertypes[0])))
+
+typedef struct eso_FilterString {
+  char *value;
+  size_t length;
+} eso_FilterString;
+
+// the values added for one filter type, any of which is accepted
+typedef struct eso_EventFilter {
+  unsigned char type;
+  unsigned char argument;
+  unsigned char booleans;  // bit 0 accepts false, bit 1 accepts true
+  unsigned long long mask; // small non-negative integers, one bit each
+  lua_Number *numbers;     // all other numbers
+  int numberCount;
+  int numberCapacity;
+  eso_FilterString *strings; // prefixes for the prefix filter types
+  int stringCount;
+  int stringCapacity;
+} eso_EventFilter;
+
+typedef struct eso_EventHandler {
+  int callback;  // registry ref, LUA_NOREF once unregistered
+  int namespace; // registry ref, LUA_NOREF once unregistered
+  int stats;     // index into eso_handlerstats
+  unsigned int generation;
+  eso_EventFilter *filters; // one per type, all of them have to match
+  int filterCount;
+  int filterCapacity;
+} eso_EventHandler;
+
+typedef struct eso_EventList {
+  eso_EventHandler *handlers;
+  int count;
+  int capacity;
+  int live;
+  int filtered; // live handlers with at least one filter
+  unsigned int generation; // of the next handler
+  unsigned char filterArguments[ESO_FILTER_TYPES]; // 0 for the default
+} eso_EventList;
+
+typedef struct eso_PendingEvent {
+  int slot;
+  int stack;
+  int base;
+  int argc; // including the event itself
+  int count; // handlers in the list when it was triggered
+  unsigned int generation;
+} eso_PendingEvent;
+
+typedef struct eso_EventQueue {
+  eso_PendingEvent *events;
+  int count;
+  int capacity;
+  lua_State **stacks;
+  int stackCount;
+  int stackCapacity;
+  int current;
+  int maxArgc;
+} eso_EventQueue;
+
+static eso_EventList *eso_eventlists = NULL;
+static int eso_eventlistcount = 0;
+static int eso_eventlistcapacity = 0;
+static eso_EventQueue eso_eventqueues[2];
+static int eso_activeeventqueue = 0;
+static bool eso_dispatchingevents = false;
+static bool eso_eventlistsdirty = false;
+
+// the registered handlers are stored with eso_pusheventstate, but not what
+// is still waiting to run
+static bool eso_haspendingeventstate() {
+  return eso_eventqueues[0].count > 0 || eso_eventqueues[1].count > 0 ||
+         eso_updateheapsize > 0 || eso_taskcount > 0;
+}
+
+// returns the slot for the event at idx, or -1 if it has none and should not
+// get one
+static int eso_geteventslot(lua_State *L, int idx, bool create) {
+  lua_getfield(L, LUA_REGISTRYINDEX, ESO_EVENTS_INDEX);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, -2);
+  int slot = lua_isnil(L, -1) ? -1 : (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  if (slot < 0 && create) {
+    if (!eso_growarray((void **)&eso_eventlists, &eso_eventlistcapacity,
+                       eso_eventlistcount, sizeof(eso_EventList))) {
+      luaL_error(L, "not enough memory");
+    }
+    slot = eso_eventlistcount++;
+    memset(&eso_eventlists[slot], 0, sizeof(eso_EventList));
+
+    lua_pushvalue(L, idx);
+    lua_pushinteger(L, slot);
+    lua_rawset(L, -3);
+    lua_getfield(L, LUA_REGISTRYINDEX, ESO_EVENTS_NAMESPACES);
+    lua_newtable(L);
+    lua_rawseti(L, -2, slot);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return slot;
+}
+
+static void eso_pusheventnamespaces(lua_State *L, int slot) {
+  lua_getfield(L, LUA_REGISTRYINDEX, ESO_EVENTS_NAMESPACES);
+  lua_rawgeti(L, -1, slot);
+  lua_remove(L, -2);
+}
+
+static void eso_freeeventfilters(eso_EventHandler *handler) {
+  for (int i = 0; i < handler->filterCount; ++i) {
+    eso_EventFilter *filter = &handler->filters[i];
+    for (int j = 0; j < filter->stringCount; ++j) {
+      free(filter->strings[j].value);
+    }
+    free(filter->strings);
+    free(filter->numbers);
+  }
+  free(handler->filters);
+  handler->filters = NULL;
+  handler->filterCount = 0;
+  handler->filterCapacity = 0;
+}
+
+static bool eso_matcheseventfilter(lua_State *stack, int base, int argc,
+                                   const eso_EventFilter *filter) {
+  // base is the event code, so the position is also the offset
+  if (filter->argument >= argc) {
+    return false;
+  }
+  int idx = base + filter->argument;
+  switch (lua_type(stack, idx)) {
+  case LUA_TBOOLEAN:
+    return (filter->booleans >> lua_toboolean(stack, idx) & 1) != 0;
+  case LUA_TNUMBER: {
+    lua_Number value = lua_tonumber(stack, idx);
+    if (value >= 0 && value < 64 && value == (int)value) {
+      return (filter->mask >> (int)value & 1) != 0;
+    }
+    for (int i = 0; i < filter->numberCount; ++i) {
+      if (filter->numbers[i] == value) {
+        return true;
+      }
+    }
+    return false;
+  }
+  case LUA_TSTRING: {
+    size_t length;
+    const char *value = lua_tolstring(stack, idx, &length);
+    bool prefix = eso_filtertypes[filter->type].prefix;
+    for (int i = 0; i < filter->stringCount; ++i) {
+      const eso_FilterString *string = &filter->strings[i];
+      if ((prefix ? length >= string->length : length == string->length) &&
+          memcmp(value, string->value, string->length) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+  default:
+    return false;
+  }
+}
+
+static bool eso_matcheseventfilters(lua_State *stack, int base, int argc,
+                                    const eso_EventHandler *handler) {
+  for (int i = 0; i < handler->filterCount; ++i) {
+    if (!eso_matcheseventfilter(stack, base, argc, &handler->filters[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void eso_compacteventlist(lua_State *L, int slot) {
+  eso_EventList *list = &eso_eventlists[slot];
+  if (list->live == list->count) {
+    return;
+  }
+
+  eso_pusheventnamespaces(L, slot);
+  int count = 0;
+  for (int i = 0; i < list->count; ++i) {
+    eso_EventHandler *handler = &list->handlers[i];
+    if (handler->callback == LUA_NOREF) {
+      continue;
+    }
+    if (count != i) {
+      list->handlers[count] = *handler;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, handler->namespace);
+      lua_pushinteger(L, count);
+      lua_rawset(L, -3);
+    }
+    count++;
+  }
+  list->count = count;
+  lua_pop(L, 1);
+}
+
+static void eso_cleareventqueue(eso_EventQueue *queue) {
+  for (int i = 0; i <= queue->current && i < queue->stackCount; ++i) {
+    lua_settop(queue->stacks[i], 0);
+  }
+  queue->count = 0;
+  queue->current = 0;
+  queue->maxArgc = 0;
+}
+
+// reserves room for the arguments on the current stack of the queue, plus
+// room for dispatching to copy the largest argument list on top of them
+static lua_State *eso_reserveeventargs(lua_State *L, eso_EventQueue *queue,
+                                       int argc) {
+  if (argc > queue->maxArgc) {
+    queue->maxArgc = argc;
+  }
+  while (queue->current < queue->stackCount &&
+         !lua_checkstack(queue->stacks[queue->current],
+                         argc + queue->maxArgc)) {
+    queue->current++;
+  }
+  if (queue->current == queue->stackCount) {
+    if (!eso_growarray((void **)&queue->stacks, &queue->stackCapacity,
+                       queue->stackCount, sizeof(lua_State *))) {
+      luaL_error(L, "not enough memory");
+    }
+    lua_State *stack = lua_newthread(L);
+    luaL_ref(L, LUA_REGISTRYINDEX); // never released
+    if (!lua_checkstack(stack, argc + queue->maxArgc)) {
+      luaL_error(L, "too many arguments for event");
+    }
+    queue->stacks[queue->stackCount++] = stack;
+  }
+  return queue->stacks[queue->current];
+}
+
+// adds a handler for the namespace at ns, which is not registered for the
+// event yet, with the callback at callback
+static eso_EventHandler *eso_addeventhandler(lua_State *L, int slot, int ns,
+                                             int callback) {
+  int stats = eso_gethandlerstats(L, ns);
+  eso_EventList *list = &eso_eventlists[slot];
+  if (!eso_growarray((void **)&list->handlers, &list->capacity, list->count,
+                     sizeof(eso_EventHandler))) {
+    luaL_error(L, "not enough memory");
+  }
+  eso_pusheventnamespaces(L, slot);
+  lua_pushvalue(L, ns);
+  lua_pushinteger(L, list->count);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+
+  eso_EventHandler *handler = &list->handlers[list->count++];
+  memset(handler, 0, sizeof(eso_EventHandler));
+  lua_pushvalue(L, callback);
+  handler->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, ns);
+  handler->namespace = luaL_ref(L, LUA_REGISTRYINDEX);
+  handler->stats = stats;
+  handler->generation = list->generation++;
+  list->live++;
+  return handler;
+}
+
+static int esoL_registerforevent(lua_State *L) {
+  if (lua_type(L, 2) != LUA_TSTRING || !lua_toboolean(L, 3) ||
+      !lua_toboolean(L, 4)) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  int slot = eso_geteventslot(L, 3, true);
+  eso_pusheventnamespaces(L, slot);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1)) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  lua_pop(L, 2);
+
+  eso_addeventhandler(L, slot, 2, 4);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int esoL_unregisterforevent(lua_State *L) {
+  int slot = -1;
+  if (lua_type(L, 2) == LUA_TSTRING && lua_toboolean(L, 3)) {
+    slot = eso_geteventslot(L, 3, false);
+  }
+  if (slot < 0) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  eso_pusheventnamespaces(L, slot);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1)) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  eso_EventList *list = &eso_eventlists[slot];
+  eso_EventHandler *handler = &list->handlers[lua_tointeger(L, -1)];
+  luaL_unref(L, LUA_REGISTRYINDEX, handler->callback);
+  luaL_unref(L, LUA_REGISTRYINDEX, handler->namespace);
+  handler->callback = LUA_NOREF;
+  handler->namespace = LUA_NOREF;
+  if (handler->filterCount > 0) {
+    list->filtered--;
+  }
+  eso_freeeventfilters(handler);
+  list->live--;
+  lua_pop(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+
+  if (eso_dispatchingevents) {
+    eso_eventlistsdirty = true;
+  } else {
+    eso_compacteventlist(L, slot);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// returns the filter type for the type at idx and the value above it, or -1
+// if either of them is invalid
+static int eso_checkeventfilter(lua_State *L, int idx) {
+  if (!lua_isnumber(L, idx)) {
+    return -1;
+  }
+  lua_Number number = lua_tonumber(L, idx);
+  if (!(number >= 1 && number <= ESO_FILTER_TYPES) || number != (int)number) {
+    return -1;
+  }
+  int valueType = lua_type(L, idx + 1);
+  if (valueType != LUA_TSTRING && valueType != LUA_TBOOLEAN &&
+      valueType != LUA_TNUMBER) {
+    return -1;
+  }
+  return (int)number - 1;
+}
+
+static eso_EventFilter *eso_geteventfilter(lua_State *L, eso_EventList *list,
+                                           eso_EventHandler *handler,
+                                           int type) {
+  for (int i = 0; i < handler->filterCount; ++i) {
+    if (handler->filters[i].type == type) {
+      return &handler->filters[i];
+    }
+  }
+
+  if (!eso_growarray((void **)&handler->filters, &handler->filterCapacity,
+                     handler->filterCount, sizeof(eso_EventFilter))) {
+    luaL_error(L, "not enough memory");
+  }
+  if (handler->filterCount == 0) {
+    list->filtered++;
+  }
+  eso_EventFilter *filter = &handler->filters[handler->filterCount++];
+  memset(filter, 0, sizeof(eso_EventFilter));
+  filter->type = type;
+  filter->argument = list->filterArguments[type] > 0
+                         ? list->filterArguments[type]
+                         : eso_filtertypes[type].argument;
+  return filter;
+}
+
+static void eso_addeventfiltervalue(lua_State *L, eso_EventFilter *filter,
+                                    int idx) {
+  switch (lua_type(L, idx)) {
+  case LUA_TBOOLEAN:
+    filter->booleans |= 1 << lua_toboolean(L, idx);
+    break;
+  case LUA_TNUMBER: {
+    lua_Number number = lua_tonumber(L, idx);
+    if (number >= 0 && number < 64 && number == (int)number) {
+      filter->mask |= 1ULL << (int)number;
+    } else if (eso_growarray((void **)&filter->numbers,
+                             &filter->numberCapacity, filter->numberCount,
+                             sizeof(lua_Number))) {
+      filter->numbers[filter->numberCount++] = number;
+    } else {
+      luaL_error(L, "not enough memory");
+    }
+    break;
+  }
+  default: {
+    size_t length;
+    const char *value = lua_tolstring(L, idx, &length);
+    char *copy = eso_copystring(value, length);
+    if (copy == NULL ||
+        !eso_growarray((void **)&filter->strings, &filter->stringCapacity,
+                       filter->stringCount, sizeof(eso_FilterString))) {
+      free(copy);
+      luaL_error(L, "not enough memory");
+    }
+    filter->strings[filter->stringCount].value = copy;
+    filter->strings[filter->stringCount++].length = length;
+    break;
+  }
+  }
+}
+
+// AddFilterForEvent(namespace, event, filterType, filterValue, ...)
+//
+// several values for the same filter type accept any of them, while
+// different filter types all have to match; nothing is added unless all
+// pairs are valid
+static int esoL_addfilterforevent(lua_State *L) {
+  int slot = -1;
+  if (lua_type(L, 2) == LUA_TSTRING && lua_toboolean(L, 3)) {
+    slot = eso_geteventslot(L, 3, false);
+  }
+  if (slot < 0) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  int top = lua_gettop(L);
+  eso_pusheventnamespaces(L, slot);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1) || top < 5 || (top - 3) % 2 != 0) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  for (int idx = 4; idx < top; idx += 2) {
+    if (eso_checkeventfilter(L, idx) < 0) {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  }
+
+  eso_EventList *list = &eso_eventlists[slot];
+  eso_EventHandler *handler = &list->handlers[lua_tointeger(L, -1)];
+  for (int idx = 4; idx < top; idx += 2) {
+    int type = eso_checkeventfilter(L, idx);
+    eso_addeventfiltervalue(L, eso_geteventfilter(L, list, handler, type),
+                            idx + 1);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// eso.SetEventFilterArgument(event, filterType, position) changes which
+// argument after the event code filters of that type are tested against;
+// filters that were already added keep their position
+static int esoL_seteventfilterargument(lua_State *L) {
+  luaL_checkany(L, 1);
+  int type = luaL_checkint(L, 2) - 1;
+  int argument = luaL_checkint(L, 3);
+  luaL_argcheck(L, type >= 0 && type < ESO_FILTER_TYPES, 2,
+                "unknown filter type");
+  luaL_argcheck(L, argument > 0 && argument <= UCHAR_MAX, 3,
+                "invalid argument position");
+  int slot = eso_geteventslot(L, 1, true);
+  eso_eventlists[slot].filterArguments[type] = argument;
+  return 0;
+}
+
+// true when at least one handler would be called for the event at base
+static bool eso_haseventreceiver(lua_State *L, const eso_EventList *list,
+                                 int base, int argc) {
+  if (list->filtered < list->live) {
+    return true;
+  }
+  for (int h = 0; h < list->count; ++h) {
+    const eso_EventHandler *handler = &list->handlers[h];
+    if (handler->callback != LUA_NOREF &&
+        eso_matcheseventfilters(L, base, argc, handler)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// queues the event at base with the arguments above it, which are popped
+static void eso_triggerevent(lua_State *L, int base) {
+  int argc = lua_gettop(L) - base + 1;
+  int slot = eso_geteventslot(L, base, false);
+  if (slot < 0 || eso_eventlists[slot].live == 0 ||
+      !eso_haseventreceiver(L, &eso_eventlists[slot], base, argc)) {
+    lua_settop(L, base - 1);
+    return;
+  }
+
+  eso_EventQueue *queue = &eso_eventqueues[eso_activeeventqueue];
+  if (!eso_growarray((void **)&queue->events, &queue->capacity, queue->count,
+                     sizeof(eso_PendingEvent))) {
+    luaL_error(L, "not enough memory");
+  }
+
+  lua_State *stack = eso_reserveeventargs(L, queue, argc);
+  eso_PendingEvent *event = &queue->events[queue->count++];
+  event->slot = slot;
+  event->stack = queue->current;
+  event->base = lua_gettop(stack) + 1;
+  event->argc = argc;
+  event->count = eso_eventlists[slot].count;
+  event->generation = eso_eventlists[slot].generation;
+  lua_xmove(L, stack, argc);
+}
+
+static int esoL_triggerevent(lua_State *L) {
+  luaL_checkany(L, 1);
+  eso_triggerevent(L, 1);
+  return 0;
+}
+
+// calls the handlers for all pending events and returns how many were called
+static int eso_dispatchevents(lua_State *L) {
+  if (eso_dispatchingevents) { // called from a handler
+    return 0;
+  }
+
+  eso_EventQueue *queue = &eso_eventqueues[eso_activeeventqueue];
+  eso_activeeventqueue = 1 - eso_activeeventqueue;
+  eso_dispatchingevents = true;
+  if (queue->count > 0) {
+    eso_log("Run %d pending events", queue->count);
+  }
+
+  int calls = 0;
+  for (int i = 0; i < queue->count; ++i) {
+    const eso_PendingEvent *event = &queue->events[i];
+    lua_State *stack = queue->stacks[event->stack];
+    // compacting only moves handlers down, so those of the event are all
+    // below its count; the lists are looked up again for every call, as
+    // handlers can register new ones
+    for (int h = 0; h < event->count && h < eso_eventlists[event->slot].count;
+         ++h) {
+      const eso_EventHandler *handler =
+          &eso_eventlists[event->slot].handlers[h];
+      if (handler->generation >= event->generation) {
+        break; // registered after the event was triggered
+      }
+      int callback = handler->callback;
+      if (callback == LUA_NOREF ||
+          !eso_matcheseventfilters(stack, event->base, event->argc, handler)) {
+        continue;
+      }
+      if (!lua_checkstack(L, event->argc + 1) ||
+          !lua_checkstack(stack, event->argc)) {
+        printf("Error in event handler: too many arguments for event\n");
+        continue;
+      }
+
+      int stats = handler->stats;
+      eso_HandlerCall call;
+      eso_beginhandler(L, &call);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, callback);
+      for (int a = 0; a < event->argc; ++a) {
+        lua_pushvalue(stack, event->base + a);
+      }
+      lua_xmove(stack, L, event->argc);
+      if (lua_pcall(L, event->argc, 0, 0) != 0) {
+        const char *message = lua_tostring(L, -1);
+        printf("Error in event handler: %s\n",
+               message != NULL ? message : "(error object is not a string)");
+        lua_pop(L, 1);
+      }
+      eso_endhandler(L, stats, &call);
+      calls++;
+    }
+  }
+
+  eso_cleareventqueue(queue);
+  eso_dispatchingevents = false;
+  if (eso_eventlistsdirty) {
+    for (int slot = 0; slot < eso_eventlistcount; ++slot) {
+      eso_compacteventlist(L, slot);
+    }
+    eso_eventlistsdirty = false;
+  }
+  return calls;
+}
+
+static int esoL_handlependingevents(lua_State *L) {
+  lua_pushinteger(L, eso_dispatchevents(L));
+  return 1;
+}
+
+static int esoL_getnumpendingevents(lua_State *L) {
+  lua_pushinteger(L, eso_eventqueues[eso_activeeventqueue].count);
+  return 1;
+}
+
+static int esoL_clearpendingevents(lua_State *L) {
+  (void)L;
+  eso_cleareventqueue(&eso_eventqueues[eso_activeeventqueue]);
+  return 0;
+}
+
+// pushes the registered handlers as plain values for the image: one entry
+// per event {event, filter positions, handler...}, with each handler as
+// {namespace, callback, filter type, value, ...}
+static void eso_pusheventstate(lua_State *L) {
+  lua_newtable(L);
+  int state = lua_gettop(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, ESO_EVENTS_INDEX);
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    const eso_EventList *list = &eso_eventlists[lua_tointeger(L, -1)];
+    lua_pop(L, 1);
+    lua_createtable(L, list->live + 2, 0);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, 1);
+    lua_createtable(L, ESO_FILTER_TYPES, 0);
+    for (int type = 0; type < ESO_FILTER_TYPES; ++type) {
+      lua_pushinteger(L, list->filterArguments[type]);
+      lua_rawseti(L, -2, type + 1);
+    }
+    lua_rawseti(L, -2, 2);
+
+    int n = 2;
+    for (int h = 0; h < list->count; ++h) {
+      const eso_EventHandler *handler = &list->handlers[h];
+      if (handler->callback == LUA_NOREF) {
+        continue;
+      }
+      lua_newtable(L);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, handler->namespace);
+      lua_rawseti(L, -2, 1);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, handler->callback);
+      lua_rawseti(L, -2, 2);
+      int m = 2;
+      for (int i = 0; i < handler->filterCount; ++i) {
+        const eso_EventFilter *filter = &handler->filters[i];
+        for (int value = 0; value < 2; ++value) {
+          if (filter->booleans >> value & 1) {
+            lua_pushinteger(L, filter->type + 1);
+            lua_rawseti(L, -2, ++m);
+            lua_pushboolean(L, value);
+            lua_rawseti(L, -2, ++m);
+          }
+        }
+        for (int value = 0; value < 64; ++value) {
+          if (filter->mask >> value & 1) {
+            lua_pushinteger(L, filter->type + 1);
+            lua_rawseti(L, -2, ++m);
+            lua_pushinteger(L, value);
+            lua_rawseti(L, -2, ++m);
+          }
+        }
+        for (int j = 0; j < filter->numberCount; ++j) {
+          lua_pushinteger(L, filter->type + 1);
+          lua_rawseti(L, -2, ++m);
+          lua_pushnumber(L, filter->numbers[j]);
+          lua_rawseti(L, -2, ++m);
+        }
+        for (int j = 0; j < filter->stringCount; ++j) {
+          lua_pushinteger(L, filter->type + 1);
+          lua_rawseti(L, -2, ++m);
+          lua_pushlstring(L, filter->strings[j].value,
+                          filter->strings[j].length);
+          lua_rawseti(L, -2, ++m);
+        }
+      }
+      lua_rawseti(L, -2, ++n);
+    }
+    lua_rawseti(L, state, (int)lua_objlen(L, state) + 1);
+  }
+  lua_pop(L, 1);
+}
+
+// registers the handlers from the table at idx, which eso_pusheventstate
+// created before the image was written
+static void eso_restoreeventstate(lua_State *L, int idx) {
+  int events = (int)lua_objlen(L, idx);
+  for (int i = 1; i <= events; ++i) {
+    lua_rawgeti(L, idx, i);
+    int entry = lua_gettop(L);
+    lua_rawgeti(L, entry, 1);
+    lua_rawgeti(L, entry, 2);
+    if (lua_isnil(L, -2) || !lua_istable(L, -1)) {
+      luaL_error(L, "corrupt event handlers in image");
+    }
+    int slot = eso_geteventslot(L, entry + 1, true);
+    eso_EventList *list = &eso_eventlists[slot];
+    for (int type = 0; type < ESO_FILTER_TYPES; ++type) {
+      lua_rawgeti(L, -1, type + 1);
+      list->filterArguments[type] = (unsigned char)lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+
+    int count = (int)lua_objlen(L, entry);
+    for (int h = 3; h <= count; ++h) {
+      lua_rawgeti(L, entry, h);
+      int handlerEntry = lua_gettop(L);
+      lua_rawgeti(L, handlerEntry, 1);
+      lua_rawgeti(L, handlerEntry, 2);
+      if (lua_type(L, -2) != LUA_TSTRING || !lua_isfunction(L, -1)) {
+        luaL_error(L, "corrupt event handlers in image");
+      }
+      eso_EventHandler *handler =
+          eso_addeventhandler(L, slot, handlerEntry + 1, handlerEntry + 2);
+      int filters = (int)lua_objlen(L, handlerEntry);
+      for (int f = 3; f < filters; f += 2) {
+        lua_rawgeti(L, handlerEntry, f);
+        lua_rawgeti(L, handlerEntry, f + 1);
+        int type = eso_checkeventfilter(L, -2);
+        if (type < 0) {
+          luaL_error(L, "corrupt event handlers in image");
+        }
+        eso_addeventfiltervalue(
+            L, eso_geteventfilter(L, &eso_eventlists[slot], handler, type),
+            -1);
+        lua_pop(L, 2);
+      }
+      lua_settop(L, handlerEntry - 1);
+    }
+    lua_settop(L, entry - 1);
+  }
+}
+
+static const luaL_Reg eso_eventmanager[] = {
+    {"RegisterForEvent", esoL_registerforevent},
+    {"UnregisterForEvent", esoL_unregisterforevent},
+    {"AddFilterForEvent", esoL_addfilterforevent},
+    {"RegisterForUpdate", esoL_registerforupdate},
+    {"UnregisterForUpdate", esoL_unregisterforupdate},
+    {NULL, NULL}};
+
+// expects the eso table on top of the stack
+static void eso_openevents(lua_State *L) {
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, ESO_EVENTS_INDEX);
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, ESO_EVENTS_NAMESPACES);
+  eso_openupdates(L);
+
+  lua_newtable(L);
+  luaL_register(L, NULL, eso_eventmanager);
+  lua_setfield(L, -2, "EventManager");
+
+  for (int type = 0; type < ESO_FILTER_TYPES; ++type) {
+    lua_pushinteger(L, type + 1);
+    lua_setglobal(L, eso_filtertypes[type].name);
+  }
+}
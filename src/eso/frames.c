@@ -0,0 +1,112 @@
+// a frame dispatches the pending events and then runs the updates that are
+// due; RunFrames drives a fixed number of them on the virtual clock and
+// reports how long each one took
+
+static int esoL_runframe(lua_State *L) {
+  eso_frametime = eso_getgametimemilliseconds(false);
+  int calls = eso_dispatchevents(L);
+  calls += eso_runupdates(L, eso_frametime);
+  eso_endhandlerframe();
+  calls += eso_runtasks(L);
+  lua_pushinteger(L, calls);
+  return 1;
+}
+
+static int esoL_getframetimemilliseconds(lua_State *L) {
+  lua_pushnumber(L, eso_frametime);
+  return 1;
+}
+
+static int esoL_getframetimeseconds(lua_State *L) {
+  lua_pushnumber(L, eso_frametime / 1000);
+  return 1;
+}
+
+static void eso_pushframestats(lua_State *L, double *values, int count) {
+  double total = 0;
+  for (int i = 0; i < count; ++i) {
+    total += values[i];
+  }
+  qsort(values, count, sizeof(double), eso_comparenumbers);
+  eso_pushpercentiles(L, values, count, total);
+}
+
+// the virtual clock is switched on for the run if it is not already, so the
+// frames do not wait for real time to pass
+static int esoL_runframes(lua_State *L) {
+  int count = luaL_checkint(L, 1);
+  lua_Number frameMs = luaL_optnumber(L, 2, ESO_FRAME_MS);
+  luaL_argcheck(L, count >= 0, 1, "frame count must not be negative");
+  luaL_argcheck(L, frameMs >= 0, 2, "frame time must not be negative");
+  if (eso_profilingframes) {
+    return luaL_error(L, "frames are already being run");
+  }
+
+  double *values = malloc(3 * (count > 0 ? count : 1) * sizeof(double));
+  if (values == NULL) {
+    return luaL_error(L, "not enough memory");
+  }
+  double *times = values;
+  double *allocations = values + count;
+  double *frees = values + 2 * count;
+
+  bool wasVirtual = eso_beginvirtualclock();
+  eso_log("Run %d frames of %.14gms", count, frameMs);
+
+  eso_FrameProfile worst[ESO_WORSTFRAMES];
+  int worstCount = 0;
+  memset(&eso_currentframe, 0, sizeof(eso_FrameProfile));
+  eso_profilingframes = true;
+  lua_pushcfunction(L, esoL_runframe); // reused, so frames create no garbage
+  for (int i = 0; i < count; ++i) {
+    eso_virtualtime += frameMs;
+    size_t allocated = eso_getallocatedbytes(L);
+    size_t freed = eso_getfreedbytes(L);
+    double start = eso_getclock();
+    lua_pushvalue(L, -1);
+    if (lua_pcall(L, 0, 0, 0) != 0) {
+      const char *message = lua_tostring(L, -1);
+      printf("Error in frame %d: %s\n", i + 1,
+             message != NULL ? message : "(error object is not a string)");
+      lua_pop(L, 1);
+    }
+    times[i] = eso_getclock() - start;
+    allocations[i] = eso_getallocatedbytes(L) - allocated;
+    frees[i] = eso_getfreedbytes(L) - freed;
+
+    eso_currentframe.frame = i + 1;
+    eso_currentframe.time = times[i];
+    eso_currentframe.allocated = allocations[i];
+    eso_currentframe.freed = frees[i];
+    eso_keepframeprofile(worst, &worstCount);
+  }
+  eso_profilingframes = false;
+  eso_endvirtualclock(wasVirtual);
+  lua_pop(L, 1);
+
+  lua_createtable(L, 0, 5);
+  lua_pushinteger(L, count);
+  lua_setfield(L, -2, "frames");
+  eso_pushframestats(L, times, count);
+  lua_setfield(L, -2, "time");
+  eso_pushframestats(L, allocations, count);
+  lua_setfield(L, -2, "allocated");
+  eso_pushframestats(L, frees, count);
+  lua_setfield(L, -2, "freed");
+  lua_createtable(L, worstCount, 0);
+  for (int i = 0; i < worstCount; ++i) {
+    eso_pushframeprofile(L, &worst[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "worst");
+
+  for (int i = 0; i < worstCount; ++i) {
+    eso_clearframeprofile(&worst[i]);
+    free(worst[i].namespaces);
+  }
+  eso_clearframeprofile(&eso_currentframe);
+  free(eso_currentframe.namespaces);
+  memset(&eso_currentframe, 0, sizeof(eso_FrameProfile));
+  free(values);
+  return 1;
+}
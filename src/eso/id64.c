@@ -38,9 +38,68 @@ static inline lua_Number eso_reinterpretId64AsNumber(eso_id64 value) {
   return result;
 }
 
+static const char eso_digitpairs[] = "00010203040506070809"
+                                    "10111213141516171819"
+                                    "20212223242526272829"
+                                    "30313233343536373839"
+                                    "40414243444546474849"
+                                    "50515253545556575859"
+                                    "60616263646566676869"
+                                    "70717273747576777879"
+                                    "80818283848586878889"
+                                    "90919293949596979899";
+
+// behaves like strtoull with base 10, including the wrap around for negative
+// values and saturating on overflow, but reads two digits at a time
 static eso_id64 eso_convertId64StringToId64(const char *str) {
-  char *s;
-  return strtoull(str, &s, 10);
+  while (isspace((unsigned char)*str)) {
+    str++;
+  }
+  bool negative = *str == '-';
+  if (*str == '-' || *str == '+') {
+    str++;
+  }
+  while (*str == '0') {
+    str++;
+  }
+  const char *end = str;
+  while ((unsigned)(*end - '0') < 10) {
+    end++;
+  }
+  size_t length = end - str;
+  if (length > ESO_MAXNUMBER2STR ||
+      (length == ESO_MAXNUMBER2STR &&
+       memcmp(str, "18446744073709551615", ESO_MAXNUMBER2STR) > 0)) {
+    return ULLONG_MAX;
+  }
+
+  eso_id64 value = 0;
+  if (length & 1) {
+    value = *str++ - '0';
+  }
+  while (str < end) {
+    value = value * 100 + (str[0] - '0') * 10 + (str[1] - '0');
+    str += 2;
+  }
+  return negative ? 0 - value : value;
+}
+
+// writes the digits so they end right before end and returns the first one
+static char *eso_convertId64ToString(eso_id64 value, char *end) {
+  char *s = end;
+  while (value >= 100) {
+    const char *pair = &eso_digitpairs[(value % 100) * 2];
+    value /= 100;
+    *--s = pair[1];
+    *--s = pair[0];
+  }
+  if (value >= 10) {
+    *--s = eso_digitpairs[value * 2 + 1];
+    *--s = eso_digitpairs[value * 2];
+  } else {
+    *--s = (char)('0' + value);
+  }
+  return s;
 }
 
 static int eso_compareId64s(eso_id64 a, eso_id64 b) {
@@ -65,8 +124,48 @@ static int esoL_id64tostring(lua_State *L) {
   lua_Number d = luaL_checknumber(L, 1);
   eso_id64 n = eso_reinterpretNumberAsId64(d);
   char s[ESO_MAXNUMBER2STR];
-  sprintf(s, "%llu", n);
-  lua_pushstring(L, s);
+  char *start = eso_convertId64ToString(n, s + ESO_MAXNUMBER2STR);
+  lua_pushlstring(L, start, s + ESO_MAXNUMBER2STR - start);
+  return 1;
+}
+
+// batch variants convert a whole array into a new one with a single call
+static int esoL_stringtoid64batch(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int count = (int)lua_objlen(L, 1);
+  lua_createtable(L, count, 0);
+  for (int i = 1; i <= count; ++i) {
+    lua_rawgeti(L, 1, i);
+    const char *s = lua_tostring(L, -1);
+    if (s == NULL) {
+      return luaL_error(L, "bad value at index %d (string expected, got %s)",
+                        i, luaL_typename(L, -1));
+    }
+    eso_id64 n = eso_convertId64StringToId64(s);
+    lua_pop(L, 1);
+    lua_pushnumber(L, eso_reinterpretId64AsNumber(n));
+    lua_rawseti(L, -2, i);
+  }
+  return 1;
+}
+
+static int esoL_id64tostringbatch(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int count = (int)lua_objlen(L, 1);
+  lua_createtable(L, count, 0);
+  char s[ESO_MAXNUMBER2STR];
+  for (int i = 1; i <= count; ++i) {
+    lua_rawgeti(L, 1, i);
+    if (!lua_isnumber(L, -1)) {
+      return luaL_error(L, "bad value at index %d (number expected, got %s)",
+                        i, luaL_typename(L, -1));
+    }
+    eso_id64 n = eso_reinterpretNumberAsId64(lua_tonumber(L, -1));
+    lua_pop(L, 1);
+    char *start = eso_convertId64ToString(n, s + ESO_MAXNUMBER2STR);
+    lua_pushlstring(L, start, s + ESO_MAXNUMBER2STR - start);
+    lua_rawseti(L, -2, i);
+  }
   return 1;
 }
 
@@ -90,70 +189,311 @@ static int esoL_compareid64tonumber(lua_State *L) {
   return 1;
 }
 
-// implementation of the available bitwise operations
+// implementation of the available bitwise operations; calls to them are
+// compiled to VM instructions which compute the same result with the luai_bit
+// macros as long as the globals still hold these functions
 static int esoL_bitAnd(lua_State *L) {
   lua_Number a = luaL_checknumber(L, 1);
   lua_Number b = luaL_checknumber(L, 2);
-  eso_id64 a_ = (eso_id64)a;
-  eso_id64 b_ = (eso_id64)b;
-  lua_Number result = (lua_Number)(a_ & b_);
-  lua_pushnumber(L, result);
+  lua_pushnumber(L, luai_bitand(a, b));
   return 1;
 }
 
 static int esoL_bitOr(lua_State *L) {
   lua_Number a = luaL_checknumber(L, 1);
   lua_Number b = luaL_checknumber(L, 2);
-  eso_id64 a_ = (eso_id64)a;
-  eso_id64 b_ = (eso_id64)b;
-  lua_Number result = (lua_Number)(a_ | b_);
-  lua_pushnumber(L, result);
+  lua_pushnumber(L, luai_bitor(a, b));
   return 1;
 }
 
 static int esoL_bitXor(lua_State *L) {
   lua_Number a = luaL_checknumber(L, 1);
   lua_Number b = luaL_checknumber(L, 2);
-  eso_id64 a_ = (eso_id64)a;
-  eso_id64 b_ = (eso_id64)b;
-  lua_Number result = (lua_Number)(a_ ^ b_);
-  lua_pushnumber(L, result);
+  lua_pushnumber(L, luai_bitxor(a, b));
   return 1;
 }
 
 static int esoL_bitNot(lua_State *L) {
   int n = lua_gettop(L); /* number of arguments */
   lua_Number a = luaL_checknumber(L, 1);
-  eso_id64 numBits = 53; // 0x1FFFFFFFFFFFFF
+  eso_id64 numBits = LUAI_BITNOTBITS; // 0x1FFFFFFFFFFFFF
   if (n > 1) {
     numBits = (eso_id64)luaL_checknumber(L, 2);
-    if (numBits < 0 || numBits > 53) {
-      numBits = 53;
+    if (numBits > LUAI_BITNOTBITS) {
+      numBits = LUAI_BITNOTBITS;
     }
   }
-  eso_id64 a_ = (eso_id64)a;
-  eso_id64 mask = ((eso_id64)1 << numBits) - 1;
-  lua_Number result = (lua_Number)((~a_) & mask);
-  lua_pushnumber(L, result);
+  lua_pushnumber(L, luai_bitnot(a, numBits));
   return 1;
 }
 
 static int esoL_bitLShift(lua_State *L) {
   lua_Number a = luaL_checknumber(L, 1);
   lua_Number b = luaL_checknumber(L, 2);
-  eso_id64 a_ = (eso_id64)a;
-  eso_id64 b_ = (eso_id64)b;
-  lua_Number result = (lua_Number)(a_ << b_);
-  lua_pushnumber(L, result);
+  lua_pushnumber(L, luai_bitshl(a, b));
   return 1;
 }
 
 static int esoL_bitRShift(lua_State *L) {
   lua_Number a = luaL_checknumber(L, 1);
   lua_Number b = luaL_checknumber(L, 2);
-  eso_id64 a_ = (eso_id64)a;
-  eso_id64 b_ = (eso_id64)b;
-  lua_Number result = (lua_Number)(a_ >> b_);
-  lua_pushnumber(L, result);
+  lua_pushnumber(L, luai_bitshr(a, b));
+  return 1;
+}
+// Id64Map is a hash map keyed by the raw bit pattern of an id, as the id
+// numbers can be NaN and the Lua table cannot store those as keys; the ids
+// are kept densely in insertion order with their values at the same index in
+// the environment table, and an open addressing index with linear probing
+// and backward shift deletion points into them, so no tombstones are needed
+
+#define ESO_ID64MAP "eso.Id64Map"
+#define ESO_ID64MAP_MINCAPACITY 8
+
+typedef struct eso_Id64Map {
+  unsigned int *slots; // entry index + 1, or 0 when empty
+  size_t capacity;     // power of two
+  eso_id64 *keys;
+  size_t count;
+  size_t keyCapacity;
+} eso_Id64Map;
+
+static size_t eso_hashid64(eso_id64 id) {
+  id ^= id >> 33;
+  id *= 0xff51afd7ed558ccdULL;
+  id ^= id >> 33;
+  id *= 0xc4ceb9fe1a85ec53ULL;
+  id ^= id >> 33;
+  return (size_t)id;
+}
+
+static eso_Id64Map *eso_checkid64map(lua_State *L) {
+  return (eso_Id64Map *)luaL_checkudata(L, 1, ESO_ID64MAP);
+}
+
+// ids can be given as numbers or as strings
+static eso_id64 eso_checkid64key(lua_State *L, int idx) {
+  if (lua_type(L, idx) == LUA_TSTRING) {
+    return eso_convertId64StringToId64(lua_tostring(L, idx));
+  }
+  return eso_reinterpretNumberAsId64(luaL_checknumber(L, idx));
+}
+
+// returns the slot of the id, or the empty slot where it would go
+static size_t eso_findid64slot(const eso_Id64Map *map, eso_id64 id) {
+  size_t mask = map->capacity - 1;
+  size_t slot = eso_hashid64(id) & mask;
+  while (map->slots[slot] != 0 && map->keys[map->slots[slot] - 1] != id) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+static size_t eso_getid64mapcapacity(size_t count) {
+  size_t capacity = ESO_ID64MAP_MINCAPACITY;
+  while (capacity - capacity / 4 < count) { // at most 75% full
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+// makes room for count ids, which only rebuilds the index
+static void eso_reserveid64map(lua_State *L, eso_Id64Map *map, size_t count) {
+  if (count > INT_MAX / 2) {
+    luaL_error(L, "too many ids in map");
+  }
+  if (count > map->keyCapacity) {
+    size_t keyCapacity = map->keyCapacity * 2;
+    if (keyCapacity < count) {
+      keyCapacity = count;
+    }
+    eso_id64 *keys = realloc(map->keys, keyCapacity * sizeof(eso_id64));
+    if (keys == NULL) {
+      luaL_error(L, "not enough memory");
+    }
+    map->keys = keys;
+    map->keyCapacity = keyCapacity;
+  }
+
+  size_t capacity = eso_getid64mapcapacity(count);
+  if (capacity <= map->capacity) {
+    return;
+  }
+  unsigned int *slots = calloc(capacity, sizeof(unsigned int));
+  if (slots == NULL) {
+    luaL_error(L, "not enough memory");
+  }
+  free(map->slots);
+  map->slots = slots;
+  map->capacity = capacity;
+  for (size_t i = 0; i < map->count; ++i) {
+    map->slots[eso_findid64slot(map, map->keys[i])] = (unsigned int)i + 1;
+  }
+}
+
+// eso.Id64Map([sizeHint])
+static int esoL_newid64map(lua_State *L) {
+  lua_Number hint = luaL_optnumber(L, 1, 0);
+  size_t count = hint > 0 && hint < INT_MAX / 2 ? (size_t)hint : 0;
+  eso_Id64Map *map = (eso_Id64Map *)lua_newuserdata(L, sizeof(eso_Id64Map));
+  memset(map, 0, sizeof(eso_Id64Map));
+  luaL_getmetatable(L, ESO_ID64MAP);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, (int)count, 0);
+  lua_setfenv(L, -2);
+  eso_reserveid64map(L, map, count > 0 ? count : 1);
   return 1;
-}
\ No newline at end of file
+}
+
+static int esoL_id64mapget(lua_State *L) {
+  eso_Id64Map *map = eso_checkid64map(L);
+  size_t slot = eso_findid64slot(map, eso_checkid64key(L, 2));
+  if (map->slots[slot] == 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, map->slots[slot]);
+  return 1;
+}
+
+// removes the entry at slot, closes the gap in the index by moving back the
+// entries that were displaced past it and moves the last id into the gap in
+// the ids; expects the environment table on top of the stack
+static void eso_removeid64slot(lua_State *L, eso_Id64Map *map, size_t slot) {
+  size_t mask = map->capacity - 1;
+  unsigned int entry = map->slots[slot];
+  size_t next = (slot + 1) & mask;
+  while (map->slots[next] != 0) {
+    size_t home = eso_hashid64(map->keys[map->slots[next] - 1]) & mask;
+    // the entry can move back unless its home lies in (slot, next]
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      map->slots[slot] = map->slots[next];
+      slot = next;
+    }
+    next = (next + 1) & mask;
+  }
+  map->slots[slot] = 0;
+
+  unsigned int last = (unsigned int)map->count--;
+  if (entry != last) {
+    map->keys[entry - 1] = map->keys[last - 1];
+    map->slots[eso_findid64slot(map, map->keys[entry - 1])] = entry;
+    lua_rawgeti(L, -1, last);
+    lua_rawseti(L, -2, entry);
+  }
+  lua_pushnil(L);
+  lua_rawseti(L, -2, last);
+}
+
+// Set(id, value) where a nil value removes the id
+static int esoL_id64mapset(lua_State *L) {
+  eso_Id64Map *map = eso_checkid64map(L);
+  eso_id64 id = eso_checkid64key(L, 2);
+  luaL_checkany(L, 3);
+  lua_settop(L, 3);
+  lua_getfenv(L, 1);
+  size_t slot = eso_findid64slot(map, id);
+  if (lua_isnil(L, 3)) {
+    if (map->slots[slot] != 0) {
+      eso_removeid64slot(L, map, slot);
+    }
+    return 0;
+  }
+
+  if (map->slots[slot] == 0) {
+    if (map->count == map->keyCapacity ||
+        map->count + 1 > map->capacity - map->capacity / 4) {
+      eso_reserveid64map(L, map, map->count + 1);
+      slot = eso_findid64slot(map, id);
+    }
+    map->keys[map->count++] = id;
+    map->slots[slot] = (unsigned int)map->count;
+  }
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, map->slots[slot]);
+  return 0;
+}
+
+// returns the removed value
+static int esoL_id64mapremove(lua_State *L) {
+  eso_Id64Map *map = eso_checkid64map(L);
+  size_t slot = eso_findid64slot(map, eso_checkid64key(L, 2));
+  if (map->slots[slot] == 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_getfenv(L, 1);
+  lua_rawgeti(L, -1, map->slots[slot]);
+  lua_insert(L, -2);
+  eso_removeid64slot(L, map, slot);
+  lua_pop(L, 1);
+  return 1;
+}
+
+static int esoL_id64mapsize(lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)eso_checkid64map(L)->count);
+  return 1;
+}
+
+static int esoL_id64mapclear(lua_State *L) {
+  eso_Id64Map *map = eso_checkid64map(L);
+  memset(map->slots, 0, map->capacity * sizeof(unsigned int));
+  map->count = 0;
+  lua_newtable(L);
+  lua_setfenv(L, 1);
+  return 0;
+}
+
+static int eso_id64mapnext(lua_State *L) {
+  eso_Id64Map *map = (eso_Id64Map *)lua_touserdata(L, lua_upvalueindex(1));
+  lua_Integer entry = lua_tointeger(L, lua_upvalueindex(2));
+  if (entry >= (lua_Integer)map->count) {
+    return 0;
+  }
+  lua_pushinteger(L, entry + 1);
+  lua_replace(L, lua_upvalueindex(2));
+  lua_pushnumber(L, eso_reinterpretId64AsNumber(map->keys[entry]));
+  lua_getfenv(L, lua_upvalueindex(1));
+  lua_rawgeti(L, -1, (int)entry + 1);
+  lua_remove(L, -2);
+  return 2;
+}
+
+// for id, value in map:Iterate() do ... end visits the ids in the order they
+// were added; values can be changed while iterating, but removing an id
+// moves the last one into its place
+static int esoL_id64mapiterate(lua_State *L) {
+  eso_checkid64map(L);
+  lua_settop(L, 1);
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, eso_id64mapnext, 2);
+  return 1;
+}
+
+static int esoL_id64mapgc(lua_State *L) {
+  eso_Id64Map *map = (eso_Id64Map *)lua_touserdata(L, 1);
+  free(map->slots);
+  free(map->keys);
+  memset(map, 0, sizeof(eso_Id64Map));
+  return 0;
+}
+
+static const luaL_Reg eso_id64map[] = {{"Get", esoL_id64mapget},
+                                       {"Set", esoL_id64mapset},
+                                       {"Remove", esoL_id64mapremove},
+                                       {"GetSize", esoL_id64mapsize},
+                                       {"Clear", esoL_id64mapclear},
+                                       {"Iterate", esoL_id64mapiterate},
+                                       {NULL, NULL}};
+
+static void eso_openid64map(lua_State *L) {
+  luaL_newmetatable(L, ESO_ID64MAP);
+  lua_newtable(L);
+  luaL_register(L, NULL, eso_id64map);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, esoL_id64mapsize);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, esoL_id64mapgc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+}
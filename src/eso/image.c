@@ -0,0 +1,884 @@
+#define ESO_IMAGE_MAGIC "ESOLIMG"
+#define ESO_IMAGE_VERSION 3
+#define ESO_IMAGE_MAXDEPTH 16
+#define ESO_IMAGE_NAMES "eso.image.names"
+
+// the image stores every object reachable from _G and package.loaded that
+// did not exist right after luaL_openlibs; library tables, C functions and
+// userdata from that point are stored by name and bound again on restore;
+// the registered event handlers are stored as one more table, whose id
+// follows the content
+//
+// the header also holds a hash of the script that initialized the state and
+// a fingerprint of the ESOUI source folder, built from the path, name,
+// modification time and size of every file in it; an image that does not
+// match either of them is rejected, so the state is initialized again
+
+enum eso_ImageValueTag {
+  ESO_IMAGE_NIL,
+  ESO_IMAGE_FALSE,
+  ESO_IMAGE_TRUE,
+  ESO_IMAGE_NUMBER,
+  ESO_IMAGE_STRING,
+  ESO_IMAGE_REF,
+  ESO_IMAGE_END
+};
+
+enum eso_ImageObjectKind {
+  ESO_IMAGE_PROTO,
+  ESO_IMAGE_KNOWN,
+  ESO_IMAGE_TABLE,
+  ESO_IMAGE_UPVAL,
+  ESO_IMAGE_CLOSURE,
+  ESO_IMAGE_NUMKINDS
+};
+
+typedef struct eso_ImageHeader {
+  char magic[sizeof(ESO_IMAGE_MAGIC)];
+  unsigned int version;
+  char release[sizeof(LUA_RELEASE)];
+  char bytecode[LUAC_HEADERSIZE];
+  unsigned long long script;
+  unsigned long long sources;
+} eso_ImageHeader;
+
+typedef struct eso_ImageWriter {
+  lua_State *L;
+  FILE *fp;
+  const char *path;
+  int names;   // stack index: object -> name
+  int ids;     // stack index: object -> id
+  int objects; // stack index: id -> object
+  int count;
+  int capacity;
+  unsigned char *kinds;
+  int *aux; // upvalue index for ESO_IMAGE_UPVAL
+} eso_ImageWriter;
+
+typedef struct eso_ImageReader {
+  lua_State *L;
+  const char *path;
+  eso_Buffer data;
+  size_t position;
+  int objects; // stack index: id -> object
+  int staged;  // stack index: id -> content for a library table
+  int count;
+  unsigned char *kinds;
+  UpVal **upvals;
+} eso_ImageReader;
+
+// see eso/events.c
+static bool eso_haspendingeventstate();
+static void eso_pusheventstate(lua_State *L);
+static void eso_restoreeventstate(lua_State *L, int idx);
+
+static unsigned long long eso_imagescript = 0;
+static unsigned long long eso_imagesources = 0; // when it was prepared
+
+LUA_API void eso_set_image_script(const void *data, size_t size) {
+  eso_imagescript = eso_hash((const char *)data, size);
+}
+
+// sums the hashes of the files, so the order they are listed in does not
+// matter
+static unsigned long long eso_hashimagesources(char *path, size_t length,
+                                               int depth) {
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return 0;
+  }
+
+  unsigned long long hash = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t nameLength = strlen(entry->d_name);
+    if (entry->d_name[0] == '.' || length + nameLength + 2 > PATH_MAX) {
+      continue;
+    }
+    sprintf(path + length, "/%s", entry->d_name);
+    struct stat info;
+    if (stat(path, &info) != 0) {
+      continue;
+    }
+    if (S_ISDIR(info.st_mode)) {
+      if (depth < ESO_IMAGE_MAXDEPTH) {
+        hash += eso_hashimagesources(path, length + 1 + nameLength, depth + 1);
+      }
+    } else {
+      char stamp[64];
+      int stampLength = sprintf(stamp, "\n%.17g %.17g",
+                                (double)info.st_mtime, (double)info.st_size);
+      unsigned long long file = eso_hash(path, length + 1 + nameLength);
+      hash += file ^ eso_hash(stamp, stampLength);
+    }
+  }
+  path[length] = '\0';
+  closedir(dir);
+  return hash;
+}
+
+// fingerprints the folder in ESOUI_SOURCE_PATH
+static unsigned long long eso_getimagesources(lua_State *L) {
+  lua_getglobal(L, "ESOUI_SOURCE_PATH");
+  const char *sourcePath = lua_tostring(L, -1);
+  unsigned long long hash = 0;
+  if (sourcePath != NULL && strlen(sourcePath) < PATH_MAX) {
+    char path[PATH_MAX + 1];
+    strcpy(path, sourcePath);
+    hash = eso_hash(path, strlen(path)) +
+           eso_hashimagesources(path, strlen(path), 0);
+  }
+  lua_pop(L, 1);
+  return hash;
+}
+
+static void eso_fillimageheader(eso_ImageHeader *header,
+                                unsigned long long sources) {
+  memset(header, 0, sizeof(eso_ImageHeader));
+  memcpy(header->magic, ESO_IMAGE_MAGIC, sizeof(ESO_IMAGE_MAGIC));
+  header->version = ESO_IMAGE_VERSION;
+  memcpy(header->release, LUA_RELEASE, sizeof(LUA_RELEASE));
+  luaU_header(header->bytecode);
+  header->script = eso_imagescript;
+  header->sources = sources;
+}
+
+// names every table, function and userdata reachable through string or
+// integer keys; the first path that reaches an object wins
+static void eso_addimagenames(lua_State *L, int names, const char *path) {
+  if (!lua_istable(L, -1) && !lua_isfunction(L, -1) && !lua_isuserdata(L, -1)) {
+    return;
+  }
+
+  lua_pushvalue(L, -1);
+  lua_rawget(L, names);
+  bool known = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  if (known) {
+    return;
+  }
+
+  lua_pushvalue(L, -1);
+  lua_pushstring(L, path);
+  lua_rawset(L, names);
+  if (!lua_istable(L, -1)) {
+    return;
+  }
+
+  luaL_checkstack(L, LUA_MINSTACK, "library tables too deep");
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    if (lua_type(L, -2) == LUA_TNUMBER) {
+      lua_pushfstring(L, "%s.%d", path, (int)lua_tointeger(L, -2));
+    } else if (lua_type(L, -2) == LUA_TSTRING &&
+               strchr(lua_tostring(L, -2), '.') == NULL) {
+      lua_pushfstring(L, "%s.%s", path, lua_tostring(L, -2));
+    } else {
+      lua_pop(L, 1);
+      continue;
+    }
+    lua_insert(L, -2);
+    eso_addimagenames(L, names, lua_tostring(L, -2));
+    lua_pop(L, 2);
+  }
+}
+
+// remembers the name of every library object, so it can be stored by name,
+// and the sources the state is initialized from
+LUA_API void eso_prepare_image(lua_State *L) {
+  eso_imagesources = eso_getimagesources(L);
+  lua_newtable(L);
+  int names = lua_gettop(L);
+
+  lua_pushvalue(L, LUA_GLOBALSINDEX);
+  eso_addimagenames(L, names, "_G");
+  lua_pop(L, 1);
+
+  lua_setfield(L, LUA_REGISTRYINDEX, ESO_IMAGE_NAMES);
+}
+
+// writing
+
+static void eso_writeimage(eso_ImageWriter *W, const void *data, size_t size) {
+  if (fwrite(data, 1, size, W->fp) != size) {
+    luaL_error(W->L, "cannot write image %s", W->path);
+  }
+}
+
+static void eso_writeimagebyte(eso_ImageWriter *W, int value) {
+  unsigned char byte = (unsigned char)value;
+  eso_writeimage(W, &byte, 1);
+}
+
+static void eso_writeimageint(eso_ImageWriter *W, int value) {
+  eso_writeimage(W, &value, sizeof(value));
+}
+
+static void eso_writeimagestring(eso_ImageWriter *W, const char *s,
+                                 size_t size) {
+  eso_writeimage(W, &size, sizeof(size));
+  eso_writeimage(W, s, size);
+}
+
+// assigns an id to the object on top of the stack under the given key
+static int eso_addimageobject(eso_ImageWriter *W, int kind, int aux) {
+  lua_State *L = W->L;
+  if (W->count == W->capacity) {
+    int capacity = W->capacity * 2 + 64;
+    unsigned char *kinds = realloc(W->kinds, capacity);
+    if (kinds != NULL) {
+      W->kinds = kinds;
+    }
+    int *auxs = realloc(W->aux, capacity * sizeof(int));
+    if (auxs != NULL) {
+      W->aux = auxs;
+    }
+    if (kinds == NULL || auxs == NULL) {
+      luaL_error(L, "not enough memory to write image");
+    }
+    W->capacity = capacity;
+  }
+
+  int id = ++W->count;
+  W->kinds[id - 1] = (unsigned char)kind;
+  W->aux[id - 1] = aux;
+  lua_rawseti(L, W->objects, id);
+  lua_pushinteger(L, id);
+  lua_rawset(L, W->ids);
+  return id;
+}
+
+// the debug API cannot see the upvalues of stripped functions
+static void eso_pushimageupvalue(lua_State *L, Closure *cl, int i) {
+  setobj2s(L, L->top, cl->l.upvals[i]->v);
+  incr_top(L);
+}
+
+static int eso_getimageid(eso_ImageWriter *W) {
+  lua_State *L = W->L;
+  lua_rawget(L, W->ids);
+  int id = lua_isnil(L, -1) ? 0 : (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return id;
+}
+
+// visits a value; objects get an id so they are stored once
+static void eso_collectimagevalue(eso_ImageWriter *W, int idx) {
+  lua_State *L = W->L;
+  int type = lua_type(L, idx);
+  if (type == LUA_TNIL || type == LUA_TBOOLEAN || type == LUA_TNUMBER ||
+      type == LUA_TSTRING) {
+    return;
+  }
+
+  lua_pushvalue(L, idx);
+  if (eso_getimageid(W) != 0) {
+    return;
+  }
+
+  int kind;
+  lua_pushvalue(L, idx);
+  lua_rawget(L, W->names);
+  bool known = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  if (known) {
+    kind = ESO_IMAGE_KNOWN;
+  } else if (type == LUA_TTABLE) {
+    kind = ESO_IMAGE_TABLE;
+  } else if (type == LUA_TFUNCTION && !lua_iscfunction(L, idx)) {
+    kind = ESO_IMAGE_CLOSURE;
+  } else {
+    luaL_error(L, "cannot store %s %p in image", lua_typename(L, type),
+               lua_topointer(L, idx));
+    return;
+  }
+
+  lua_pushvalue(L, idx);
+  lua_pushvalue(L, idx);
+  eso_addimageobject(W, kind, 0);
+}
+
+static void eso_collectimagetable(eso_ImageWriter *W, int idx) {
+  lua_State *L = W->L;
+  if (lua_getmetatable(L, idx)) {
+    eso_collectimagevalue(W, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+
+  lua_pushnil(L);
+  while (lua_next(L, idx) != 0) {
+    eso_collectimagevalue(W, lua_gettop(L) - 1);
+    eso_collectimagevalue(W, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+}
+
+static void eso_collectimageclosure(eso_ImageWriter *W, int idx) {
+  lua_State *L = W->L;
+  Closure *cl = (Closure *)lua_topointer(L, idx);
+
+  lua_pushlightuserdata(L, cl->l.p);
+  if (eso_getimageid(W) == 0) {
+    lua_pushlightuserdata(L, cl->l.p);
+    lua_pushvalue(L, idx);
+    eso_addimageobject(W, ESO_IMAGE_PROTO, 0);
+  }
+
+  lua_getfenv(L, idx);
+  eso_collectimagevalue(W, lua_gettop(L));
+  lua_pop(L, 1);
+
+  for (int i = 0; i < cl->l.nupvalues; ++i) {
+    lua_pushlightuserdata(L, cl->l.upvals[i]);
+    if (eso_getimageid(W) == 0) {
+      lua_pushlightuserdata(L, cl->l.upvals[i]);
+      lua_pushvalue(L, idx);
+      eso_addimageobject(W, ESO_IMAGE_UPVAL, i);
+
+      eso_pushimageupvalue(L, cl, i);
+      eso_collectimagevalue(W, lua_gettop(L));
+      lua_pop(L, 1);
+    }
+  }
+}
+
+static void eso_writeimagevalue(eso_ImageWriter *W, int idx) {
+  lua_State *L = W->L;
+  switch (lua_type(L, idx)) {
+  case LUA_TNIL:
+    eso_writeimagebyte(W, ESO_IMAGE_NIL);
+    break;
+  case LUA_TBOOLEAN:
+    eso_writeimagebyte(W, lua_toboolean(L, idx) ? ESO_IMAGE_TRUE
+                                                : ESO_IMAGE_FALSE);
+    break;
+  case LUA_TNUMBER: {
+    lua_Number n = lua_tonumber(L, idx);
+    eso_writeimagebyte(W, ESO_IMAGE_NUMBER);
+    eso_writeimage(W, &n, sizeof(n));
+    break;
+  }
+  case LUA_TSTRING: {
+    size_t size;
+    const char *s = lua_tolstring(L, idx, &size);
+    eso_writeimagebyte(W, ESO_IMAGE_STRING);
+    eso_writeimagestring(W, s, size);
+    break;
+  }
+  default:
+    lua_pushvalue(L, idx);
+    eso_writeimagebyte(W, ESO_IMAGE_REF);
+    eso_writeimageint(W, eso_getimageid(W));
+    break;
+  }
+}
+
+static void eso_writeimageobject(eso_ImageWriter *W, int id, int idx) {
+  lua_State *L = W->L;
+  eso_writeimageint(W, id);
+  switch (W->kinds[id - 1]) {
+  case ESO_IMAGE_PROTO: {
+    Closure *cl = (Closure *)lua_topointer(L, idx);
+    eso_Buffer dump = {NULL, 0, 0};
+    int status = luaU_dump(L, cl->l.p, eso_bufferwriter, &dump, 0);
+    if (status == 0) {
+      eso_writeimagestring(W, dump.data, dump.size);
+    }
+    free(dump.data);
+    if (status != 0) {
+      luaL_error(L, "cannot dump function for image %s", W->path);
+    }
+    break;
+  }
+  case ESO_IMAGE_KNOWN: {
+    lua_pushvalue(L, idx);
+    lua_rawget(L, W->names);
+    size_t size;
+    const char *name = lua_tolstring(L, -1, &size);
+    eso_writeimagestring(W, name, size);
+    lua_pop(L, 1);
+    break;
+  }
+  case ESO_IMAGE_TABLE:
+    eso_writeimageint(W, (int)lua_objlen(L, idx));
+    break;
+  case ESO_IMAGE_UPVAL:
+    break;
+  case ESO_IMAGE_CLOSURE: {
+    Closure *cl = (Closure *)lua_topointer(L, idx);
+    lua_pushlightuserdata(L, cl->l.p);
+    eso_writeimageint(W, eso_getimageid(W));
+    break;
+  }
+  }
+}
+
+static void eso_writeimagecontent(eso_ImageWriter *W, int id, int idx) {
+  lua_State *L = W->L;
+  switch (W->kinds[id - 1]) {
+  case ESO_IMAGE_KNOWN:
+  case ESO_IMAGE_TABLE:
+    if (!lua_istable(L, idx)) {
+      return;
+    }
+    eso_writeimageint(W, id);
+    if (!lua_getmetatable(L, idx)) {
+      lua_pushnil(L);
+    }
+    eso_writeimagevalue(W, lua_gettop(L));
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+      eso_writeimagevalue(W, lua_gettop(L) - 1);
+      eso_writeimagevalue(W, lua_gettop(L));
+      lua_pop(L, 1);
+    }
+    eso_writeimagebyte(W, ESO_IMAGE_END);
+    break;
+  case ESO_IMAGE_UPVAL: {
+    // the upvalue is written through the closure that found it first
+    eso_writeimageint(W, id);
+    lua_pushvalue(L, idx);
+    eso_writeimagebyte(W, ESO_IMAGE_REF);
+    eso_writeimageint(W, eso_getimageid(W));
+    eso_writeimageint(W, W->aux[id - 1]);
+    eso_pushimageupvalue(L, (Closure *)lua_topointer(L, idx), W->aux[id - 1]);
+    eso_writeimagevalue(W, lua_gettop(L));
+    lua_pop(L, 1);
+    break;
+  }
+  case ESO_IMAGE_CLOSURE: {
+    Closure *cl = (Closure *)lua_topointer(L, idx);
+    eso_writeimageint(W, id);
+    lua_getfenv(L, idx);
+    eso_writeimagevalue(W, lua_gettop(L));
+    lua_pop(L, 1);
+    for (int i = 0; i < cl->l.nupvalues; ++i) {
+      lua_pushlightuserdata(L, cl->l.upvals[i]);
+      eso_writeimageint(W, eso_getimageid(W));
+    }
+    break;
+  }
+  }
+}
+
+static int eso_saveimage_p(lua_State *L) {
+  eso_ImageWriter *W = (eso_ImageWriter *)lua_touserdata(L, 1);
+  W->L = L;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, ESO_IMAGE_NAMES);
+  if (!lua_istable(L, -1)) {
+    return luaL_error(L, "image was not prepared before initialization");
+  }
+  W->names = lua_gettop(L);
+  // kept in C, where the image cannot see it
+  if (eso_haspendingeventstate()) {
+    return luaL_error(L, "cannot store pending events, updates or tasks");
+  }
+  lua_newtable(L);
+  W->ids = lua_gettop(L);
+  lua_newtable(L);
+  W->objects = lua_gettop(L);
+
+  lua_pushvalue(L, LUA_GLOBALSINDEX);
+  eso_collectimagevalue(W, lua_gettop(L));
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  eso_collectimagevalue(W, lua_gettop(L));
+  lua_pop(L, 2);
+  eso_pusheventstate(L);
+  eso_collectimagevalue(W, lua_gettop(L));
+  int events = lua_gettop(L);
+
+  for (int id = 1; id <= W->count; ++id) {
+    luaL_checkstack(L, LUA_MINSTACK, "image too deep");
+    lua_rawgeti(L, W->objects, id);
+    int idx = lua_gettop(L);
+    if (W->kinds[id - 1] == ESO_IMAGE_CLOSURE) {
+      eso_collectimageclosure(W, idx);
+    } else if (lua_istable(L, idx) && W->kinds[id - 1] != ESO_IMAGE_UPVAL) {
+      eso_collectimagetable(W, idx);
+    }
+    lua_settop(L, idx - 1);
+  }
+
+  eso_ImageHeader header;
+  eso_fillimageheader(&header, eso_imagesources);
+  eso_writeimage(W, &header, sizeof(header));
+  eso_writeimageint(W, W->count);
+
+  // objects are created grouped by kind, so dependencies always come first
+  for (int kind = 0; kind < ESO_IMAGE_NUMKINDS; ++kind) {
+    for (int id = 1; id <= W->count; ++id) {
+      if (W->kinds[id - 1] == kind) {
+        lua_rawgeti(L, W->objects, id);
+        eso_writeimagebyte(W, kind);
+        eso_writeimageobject(W, id, lua_gettop(L));
+        lua_pop(L, 1);
+      }
+    }
+  }
+
+  for (int id = 1; id <= W->count; ++id) {
+    lua_rawgeti(L, W->objects, id);
+    eso_writeimagecontent(W, id, lua_gettop(L));
+    lua_pop(L, 1);
+  }
+  eso_writeimageint(W, 0);
+  lua_pushvalue(L, events);
+  eso_writeimageint(W, eso_getimageid(W));
+  return 0;
+}
+
+LUA_API int eso_save_image(lua_State *L, const char *path) {
+  eso_ImageWriter W;
+  memset(&W, 0, sizeof(W));
+  W.path = path;
+  W.fp = fopen(path, "wb");
+  if (W.fp == NULL) {
+    lua_pushfstring(L, "cannot open image %s", path);
+    return LUA_ERRFILE;
+  }
+
+  lua_gc(L, LUA_GCSTOP, 0);
+  int status = lua_cpcall(L, eso_saveimage_p, &W);
+  lua_gc(L, LUA_GCRESTART, 0);
+
+  if (fclose(W.fp) != 0 && status == 0) {
+    lua_pushfstring(L, "cannot write image %s", path);
+    status = LUA_ERRFILE;
+  }
+  if (status != 0) {
+    remove(path);
+  } else {
+    eso_log("saved image with %d objects to '%s'", W.count, path);
+  }
+  free(W.kinds);
+  free(W.aux);
+  return status;
+}
+
+// reading
+
+static const void *eso_readimage(eso_ImageReader *R, size_t size) {
+  if (R->data.size - R->position < size) {
+    luaL_error(R->L, "truncated image %s", R->path);
+  }
+  const void *result = R->data.data + R->position;
+  R->position += size;
+  return result;
+}
+
+static int eso_readimagebyte(eso_ImageReader *R) {
+  return *(const unsigned char *)eso_readimage(R, 1);
+}
+
+static int eso_readimageint(eso_ImageReader *R) {
+  int value;
+  memcpy(&value, eso_readimage(R, sizeof(value)), sizeof(value));
+  return value;
+}
+
+static const char *eso_readimagestring(eso_ImageReader *R, size_t *size) {
+  memcpy(size, eso_readimage(R, sizeof(size_t)), sizeof(size_t));
+  return (const char *)eso_readimage(R, *size);
+}
+
+static int eso_readimageid(eso_ImageReader *R, int kind) {
+  int id = eso_readimageint(R);
+  if (id < 1 || id > R->count ||
+      (kind >= 0 && R->kinds[id - 1] != (unsigned char)kind)) {
+    luaL_error(R->L, "corrupt image %s", R->path);
+  }
+  return id;
+}
+
+// pushes the next value; returns false for the end marker
+static bool eso_readimagevalue(eso_ImageReader *R) {
+  lua_State *L = R->L;
+  switch (eso_readimagebyte(R)) {
+  case ESO_IMAGE_NIL:
+    lua_pushnil(L);
+    break;
+  case ESO_IMAGE_FALSE:
+    lua_pushboolean(L, 0);
+    break;
+  case ESO_IMAGE_TRUE:
+    lua_pushboolean(L, 1);
+    break;
+  case ESO_IMAGE_NUMBER: {
+    lua_Number n;
+    memcpy(&n, eso_readimage(R, sizeof(n)), sizeof(n));
+    lua_pushnumber(L, n);
+    break;
+  }
+  case ESO_IMAGE_STRING: {
+    size_t size;
+    const char *s = eso_readimagestring(R, &size);
+    lua_pushlstring(L, s, size);
+    break;
+  }
+  case ESO_IMAGE_REF: {
+    int id = eso_readimageid(R, -1);
+    if (R->kinds[id - 1] == ESO_IMAGE_UPVAL ||
+        R->kinds[id - 1] == ESO_IMAGE_PROTO) {
+      luaL_error(L, "corrupt image %s", R->path);
+    }
+    lua_rawgeti(L, R->objects, id);
+    break;
+  }
+  case ESO_IMAGE_END:
+    return false;
+  default:
+    luaL_error(L, "corrupt image %s", R->path);
+  }
+  return true;
+}
+
+static void eso_pushimagename(eso_ImageReader *R, const char *name,
+                              size_t size) {
+  lua_State *L = R->L;
+  const char *end = name + size;
+  const char *segment = name + 2;
+  if (size < 2 || memcmp(name, "_G", 2) != 0) {
+    luaL_error(L, "corrupt image %s", R->path);
+  }
+
+  lua_pushvalue(L, LUA_GLOBALSINDEX);
+  while (segment < end && lua_istable(L, -1)) {
+    const char *next = memchr(segment + 1, '.', end - segment - 1);
+    if (next == NULL) {
+      next = end;
+    }
+    // integer keys are stored as plain digits
+    const char *digit = segment + 1;
+    while (digit < next && *digit >= '0' && *digit <= '9') {
+      digit++;
+    }
+    lua_pushlstring(L, segment + 1, next - segment - 1);
+    if (digit == next && next > segment + 1) {
+      lua_pushnumber(L, lua_tonumber(L, -1));
+      lua_remove(L, -2);
+    }
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+    segment = next;
+  }
+
+  if (segment < end || lua_isnil(L, -1)) {
+    lua_pushlstring(L, name, size);
+    luaL_error(L, "cannot bind %s from image %s", lua_tostring(L, -1),
+               R->path);
+  }
+}
+
+static void eso_readimageobject(eso_ImageReader *R, int kind) {
+  lua_State *L = R->L;
+  int id = eso_readimageint(R);
+  if (id < 1 || id > R->count || R->kinds[id - 1] != ESO_IMAGE_NUMKINDS) {
+    luaL_error(L, "corrupt image %s", R->path);
+  }
+  R->kinds[id - 1] = (unsigned char)kind;
+
+  switch (kind) {
+  case ESO_IMAGE_PROTO: {
+    size_t size;
+    const char *dump = eso_readimagestring(R, &size);
+    if (luaL_loadbuffer(L, dump, size, "=image") != 0) {
+      lua_error(L);
+    }
+    break;
+  }
+  case ESO_IMAGE_KNOWN: {
+    size_t size;
+    const char *name = eso_readimagestring(R, &size);
+    eso_pushimagename(R, name, size);
+    break;
+  }
+  case ESO_IMAGE_TABLE:
+    lua_createtable(L, eso_readimageint(R), 0);
+    break;
+  case ESO_IMAGE_UPVAL:
+    R->upvals[id - 1] = luaF_newupval(L);
+    return;
+  case ESO_IMAGE_CLOSURE: {
+    int protoId = eso_readimageid(R, ESO_IMAGE_PROTO);
+    lua_rawgeti(L, R->objects, protoId);
+    Proto *p = ((Closure *)lua_topointer(L, -1))->l.p;
+    Closure *cl = luaF_newLclosure(L, p->nups, hvalue(gt(L)));
+    cl->l.p = p;
+    lua_pop(L, 1);
+    setclvalue(L, L->top, cl);
+    incr_top(L);
+    break;
+  }
+  default:
+    luaL_error(L, "corrupt image %s", R->path);
+  }
+  lua_rawseti(L, R->objects, id);
+}
+
+static void eso_readimagecontent(eso_ImageReader *R, int id) {
+  lua_State *L = R->L;
+  switch (R->kinds[id - 1]) {
+  case ESO_IMAGE_KNOWN:
+  case ESO_IMAGE_TABLE:
+    lua_rawgeti(L, R->objects, id);
+    if (!lua_istable(L, -1)) {
+      luaL_error(L, "corrupt image %s", R->path);
+    }
+    if (R->kinds[id - 1] == ESO_IMAGE_KNOWN) {
+      // library tables are live, so they are only changed once all of the
+      // image has been read; see eso_commitimage
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, R->staged, id);
+    }
+    eso_readimagevalue(R);
+    if (lua_istable(L, -1)) {
+      lua_setmetatable(L, -2);
+    } else {
+      lua_pop(L, 1);
+    }
+    while (eso_readimagevalue(R)) {
+      eso_readimagevalue(R);
+      lua_rawset(L, -3);
+    }
+    lua_pop(L, 1);
+    break;
+  case ESO_IMAGE_UPVAL: {
+    if (eso_readimagebyte(R) != ESO_IMAGE_REF) {
+      luaL_error(L, "corrupt image %s", R->path);
+    }
+    lua_rawgeti(L, R->objects, eso_readimageid(R, ESO_IMAGE_CLOSURE));
+    Closure *cl = (Closure *)lua_topointer(L, -1);
+    int index = eso_readimageint(R);
+    if (index < 0 || index >= cl->l.nupvalues) {
+      luaL_error(L, "corrupt image %s", R->path);
+    }
+    UpVal *uv = R->upvals[id - 1];
+    eso_readimagevalue(R);
+    setobj(L, uv->v, L->top - 1);
+    luaC_barrier(L, uv, L->top - 1);
+    lua_pop(L, 2);
+    break;
+  }
+  case ESO_IMAGE_CLOSURE: {
+    lua_rawgeti(L, R->objects, id);
+    Closure *cl = (Closure *)lua_topointer(L, -1);
+    eso_readimagevalue(R);
+    if (!lua_istable(L, -1) || lua_setfenv(L, -2) == 0) {
+      luaL_error(L, "corrupt image %s", R->path);
+    }
+    for (int i = 0; i < cl->l.nupvalues; ++i) {
+      UpVal *uv = R->upvals[eso_readimageid(R, ESO_IMAGE_UPVAL) - 1];
+      cl->l.upvals[i] = uv;
+      luaC_objbarrier(L, cl, uv);
+    }
+    lua_pop(L, 1);
+    break;
+  }
+  default:
+    luaL_error(L, "corrupt image %s", R->path);
+  }
+}
+
+// copies the staged content into the library tables it belongs to
+static void eso_commitimage(eso_ImageReader *R) {
+  lua_State *L = R->L;
+  lua_pushnil(L);
+  while (lua_next(L, R->staged) != 0) {
+    lua_rawgeti(L, R->objects, (int)lua_tointeger(L, -2));
+    if (lua_getmetatable(L, -2)) {
+      lua_setmetatable(L, -2);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, -3) != 0) {
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, -4);
+    }
+    lua_pop(L, 2);
+  }
+}
+
+static int eso_loadimage_p(lua_State *L) {
+  eso_ImageReader *R = (eso_ImageReader *)lua_touserdata(L, 1);
+  R->L = L;
+
+  eso_ImageHeader header;
+  eso_fillimageheader(&header, eso_getimagesources(L));
+  if (R->data.size < sizeof(header) ||
+      memcmp(R->data.data, &header, offsetof(eso_ImageHeader, script)) != 0) {
+    return luaL_error(L, "image %s was created by a different build",
+                      R->path);
+  }
+  if (memcmp(R->data.data, &header, sizeof(header)) != 0) {
+    return luaL_error(L, "image %s was created from a different eso.lua or "
+                         "ESOUI source folder",
+                      R->path);
+  }
+  R->position = sizeof(header);
+
+  R->count = eso_readimageint(R);
+  if (R->count < 0) {
+    return luaL_error(L, "corrupt image %s", R->path);
+  }
+  R->kinds = malloc(R->count + 1);
+  R->upvals = calloc(R->count + 1, sizeof(UpVal *));
+  if (R->kinds == NULL || R->upvals == NULL) {
+    return luaL_error(L, "not enough memory to load image");
+  }
+  memset(R->kinds, ESO_IMAGE_NUMKINDS, R->count);
+
+  lua_createtable(L, R->count, 0);
+  R->objects = lua_gettop(L);
+  lua_newtable(L);
+  R->staged = lua_gettop(L);
+
+  for (int i = 0; i < R->count; ++i) {
+    int kind = eso_readimagebyte(R);
+    eso_readimageobject(R, kind);
+  }
+
+  int id;
+  while ((id = eso_readimageint(R)) != 0) {
+    if (id < 0 || id > R->count) {
+      return luaL_error(L, "corrupt image %s", R->path);
+    }
+    eso_readimagecontent(R, id);
+  }
+  eso_commitimage(R);
+
+  id = eso_readimageint(R);
+  if (id <= 0 || id > R->count || R->kinds[id - 1] != ESO_IMAGE_TABLE) {
+    return luaL_error(L, "corrupt image %s", R->path);
+  }
+  lua_rawgeti(L, R->objects, id);
+  eso_restoreeventstate(L, lua_gettop(L));
+  return 0;
+}
+
+LUA_API int eso_load_image(lua_State *L, const char *path) {
+  eso_ImageReader R;
+  memset(&R, 0, sizeof(R));
+  R.path = path;
+  if (!eso_readfile(path, &R.data)) {
+    free(R.data.data);
+    lua_pushfstring(L, "cannot read image %s", path);
+    return LUA_ERRFILE;
+  }
+
+  // objects are not reachable until they have been linked together
+  lua_gc(L, LUA_GCSTOP, 0);
+  int status = lua_cpcall(L, eso_loadimage_p, &R);
+  lua_gc(L, LUA_GCRESTART, 0);
+
+  if (status == 0) {
+    eso_log("restored image with %d objects from '%s'", R.count, path);
+  }
+  free(R.kinds);
+  free(R.upvals);
+  free(R.data.data);
+  return status;
+}
@@ -0,0 +1,438 @@
+#define ESO_LAZY_INDEX "lazy.index"
+#define ESO_LAZY_MAGIC "ESOLAZY 1"
+#define ESO_LAZY_MAXLINE 4096
+
+// lazy loading defers running a file until one of the globals it defines is
+// read for the first time; which file defines what is found by scanning the
+// SETGLOBAL instructions in the main function of each compiled chunk
+//
+// only files whose main function does nothing but define their own globals
+// are deferred; a file that calls a function, writes into a table it did not
+// create or sets a global that exists already or is defined by an earlier
+// file runs at startup in its place in the list, so it can still extend what
+// the others define
+//
+// the scan results are kept in an index next to the bytecode cache, one
+// entry per file with its modification time and size, so only files that
+// changed since the last start have to be compiled:
+//   F <side effects> <mtime> <size> <global count> <path>
+//   <one line per global>
+
+// whether the main function does more than defining the globals in the
+// table at own; which registers hold tables of the file itself is tracked
+// linearly and forgotten at every instruction that can be reached by a jump
+static bool eso_haslazysideeffects(lua_State *L, const Proto *p, int own) {
+  bool *target = calloc(p->sizecode + 1, sizeof(bool));
+  if (target == NULL) {
+    return true;
+  }
+  for (int pc = 0; pc < p->sizecode; ++pc) {
+    Instruction i = p->code[pc];
+    OpCode op = GET_OPCODE(i);
+    if (op == OP_SETLIST && GETARG_C(i) == 0) {
+      pc++; // the next instruction is the real count
+    } else if (getOpMode(op) == iAsBx) {
+      int dest = pc + 1 + GETARG_sBx(i);
+      if (dest >= 0 && dest < p->sizecode) {
+        target[dest] = true;
+      }
+    } else if (testTMode(op) || (op == OP_LOADBOOL && GETARG_C(i) != 0)) {
+      target[pc + 2 < p->sizecode ? pc + 2 : p->sizecode] = true;
+    }
+  }
+
+  bool owned[MAXSTACK];
+  memset(owned, 0, sizeof(owned));
+  bool effects = false;
+  for (int pc = 0; pc < p->sizecode && !effects; ++pc) {
+    Instruction i = p->code[pc];
+    OpCode op = unfused(GET_OPCODE(i));
+    int a = GETARG_A(i);
+    if (target[pc]) {
+      memset(owned, 0, sizeof(owned));
+    }
+    switch (op) {
+    case OP_NEWTABLE:
+      owned[a] = true;
+      break;
+    case OP_CLOSURE:
+      owned[a] = true;
+      pc += p->p[GETARG_Bx(i)]->nups; // skip the upvalue pseudo-instructions
+      break;
+    case OP_MOVE:
+    case OP_GETTABLE:
+      owned[a] = owned[GETARG_B(i)];
+      break;
+    case OP_GETGLOBAL: {
+      const TValue *name = &p->k[GETARG_Bx(i)];
+      lua_pushlstring(L, svalue(name), tsvalue(name)->len);
+      lua_rawget(L, own);
+      owned[a] = !lua_isnil(L, -1);
+      lua_pop(L, 1);
+      break;
+    }
+    case OP_SETTABLE:
+      effects = !owned[a];
+      break;
+    case OP_SETLIST:
+      effects = !owned[a];
+      pc += GETARG_C(i) == 0;
+      break;
+    case OP_CALL:
+    case OP_TAILCALL:
+    case OP_TFORLOOP:
+    case OP_SETUPVAL:
+      effects = true;
+      break;
+    case OP_LOADNIL:
+      memset(owned + a, 0, GETARG_B(i) - a + 1);
+      break;
+    case OP_SELF:
+    case OP_VARARG:
+    case OP_FORLOOP:
+    case OP_FORPREP:
+      memset(owned + a, 0, MAXSTACK - a);
+      break;
+    default:
+      if (testAMode(op)) {
+        owned[a] = false;
+      }
+      break;
+    }
+  }
+  free(target);
+  return effects;
+}
+
+// pushes the index entry of the compiled chunk on top of the stack
+static void eso_scanlazyfile(lua_State *L, double mtime, double size) {
+  const Proto *p = ((const Closure *)lua_topointer(L, -1))->l.p;
+  lua_newtable(L);
+  int entry = lua_gettop(L);
+  lua_newtable(L);
+  int own = lua_gettop(L);
+  int count = 0;
+  for (int pc = 0; pc < p->sizecode; ++pc) {
+    Instruction i = p->code[pc];
+    if (GET_OPCODE(i) == OP_SETLIST && GETARG_C(i) == 0) {
+      pc++;
+    } else if (GET_OPCODE(i) == OP_SETGLOBAL) {
+      const TValue *name = &p->k[GETARG_Bx(i)];
+      lua_pushlstring(L, svalue(name), tsvalue(name)->len);
+      lua_pushvalue(L, -1);
+      lua_rawget(L, own);
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, own);
+        lua_rawseti(L, entry, ++count);
+      } else {
+        lua_pop(L, 2);
+      }
+    }
+  }
+
+  lua_pushboolean(L, eso_haslazysideeffects(L, p, own));
+  lua_setfield(L, entry, "effects");
+  lua_pop(L, 1);
+  lua_pushnumber(L, mtime);
+  lua_setfield(L, entry, "mtime");
+  lua_pushnumber(L, size);
+  lua_setfield(L, entry, "size");
+  lua_remove(L, -2); // the chunk
+}
+
+static char *eso_getlazyindexfilename() {
+  const char *cachePath = eso_getcachepath();
+  if (cachePath == NULL) {
+    return NULL;
+  }
+  char *result = malloc(strlen(cachePath) + sizeof("/" ESO_LAZY_INDEX));
+  if (result != NULL) {
+    sprintf(result, "%s/%s", cachePath, ESO_LAZY_INDEX);
+  }
+  return result;
+}
+
+// reads the saved entries into the table at entries, keyed by path
+static void eso_readlazyindex(lua_State *L, int entries) {
+  char *indexFile = eso_getlazyindexfilename();
+  FILE *fp = indexFile != NULL ? fopen(indexFile, "r") : NULL;
+  free(indexFile);
+  if (fp == NULL) {
+    return;
+  }
+
+  char line[ESO_LAZY_MAXLINE];
+  if (fgets(line, sizeof(line), fp) == NULL ||
+      strcmp(line, ESO_LAZY_MAGIC "\n") != 0) {
+    fclose(fp);
+    return;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    int effects, count, offset = 0;
+    double mtime, size;
+    size_t length = strlen(line);
+    if (length == 0 || line[length - 1] != '\n' ||
+        sscanf(line, "F %d %lf %lf %d %n", &effects, &mtime, &size, &count,
+               &offset) != 4 ||
+        offset == 0 || count < 0) {
+      break;
+    }
+    line[length - 1] = '\0';
+    lua_pushstring(L, line + offset);
+    lua_createtable(L, count, 3);
+    lua_pushboolean(L, effects);
+    lua_setfield(L, -2, "effects");
+    lua_pushnumber(L, mtime);
+    lua_setfield(L, -2, "mtime");
+    lua_pushnumber(L, size);
+    lua_setfield(L, -2, "size");
+    int i = 0;
+    while (i < count && fgets(line, sizeof(line), fp) != NULL) {
+      line[strcspn(line, "\n")] = '\0';
+      lua_pushstring(L, line);
+      lua_rawseti(L, -2, ++i);
+    }
+    if (i < count) {
+      lua_pop(L, 2);
+      break;
+    }
+    lua_rawset(L, entries);
+  }
+  fclose(fp);
+}
+
+// writes the table at entries, which maps paths to index entries
+static void eso_writelazyindex(lua_State *L, int entries) {
+  char *indexFile = eso_getlazyindexfilename();
+  if (indexFile == NULL) {
+    return;
+  }
+  eso_makecachedir(eso_getcachepath());
+
+  char tempFile[strlen(indexFile) + 32];
+  sprintf(tempFile, "%s.%ld.tmp", indexFile, (long)getpid());
+  FILE *fp = fopen(tempFile, "w");
+  if (fp == NULL) {
+    eso_log("failed to write lazy index '%s'", tempFile);
+    free(indexFile);
+    return;
+  }
+
+  fprintf(fp, "%s\n", ESO_LAZY_MAGIC);
+  lua_pushnil(L);
+  while (lua_next(L, entries) != 0) {
+    int count = (int)lua_objlen(L, -1);
+    lua_getfield(L, -1, "effects");
+    lua_getfield(L, -2, "mtime");
+    lua_getfield(L, -3, "size");
+    fprintf(fp, "F %d %.17g %.17g %d %s\n", lua_toboolean(L, -3),
+            lua_tonumber(L, -2), lua_tonumber(L, -1), count,
+            lua_tostring(L, -5));
+    lua_pop(L, 3);
+    for (int i = 1; i <= count; ++i) {
+      lua_rawgeti(L, -1, i);
+      fprintf(fp, "%s\n", lua_tostring(L, -1));
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+
+  bool success = fclose(fp) == 0;
+#if defined(_WIN32)
+  remove(indexFile);
+#endif
+  if (!success || rename(tempFile, indexFile) != 0) {
+    remove(tempFile);
+  }
+  free(indexFile);
+}
+
+// forgets all globals of the file before running it, so it only runs once;
+// on failure the error message is left on the stack
+static int eso_runlazyfile(lua_State *L, int index, int files,
+                           const char *path) {
+  lua_getfield(L, files, path);
+  int count = (int)lua_objlen(L, -1);
+  for (int i = 1; i <= count; ++i) {
+    lua_rawgeti(L, -1, i);
+    lua_pushnil(L);
+    lua_rawset(L, index);
+  }
+  lua_pop(L, 1);
+  lua_pushnil(L);
+  lua_setfield(L, files, path);
+  return eso_runluafile(L, path);
+}
+
+static int eso_lazyindex(lua_State *L) {
+  if (!lua_isstring(L, 2)) {
+    return 0;
+  }
+
+  lua_pushvalue(L, 2);
+  lua_rawget(L, lua_upvalueindex(1));
+  if (lua_isnil(L, -1)) {
+    return 0;
+  }
+
+  // nothing up the stack expects the errors of the file, so they are printed
+  // like those of event handlers
+  const char *path = lua_tostring(L, -1);
+  eso_log("lazy load '%s' for global '%s'", path, lua_tostring(L, 2));
+  if (eso_runlazyfile(L, lua_upvalueindex(1), lua_upvalueindex(2), path)) {
+    printf("Error in lazily loaded file: %s\n", lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+
+  lua_pushvalue(L, 2);
+  lua_rawget(L, 1);
+  return 1;
+}
+
+static int esoL_loadluafileslazily(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  lua_pushvalue(L, LUA_GLOBALSINDEX);
+  if (!lua_getmetatable(L, -1)) {
+    lua_newtable(L);
+  }
+  lua_getfield(L, -1, "__index");
+  if (!lua_isnil(L, -1)) {
+    eso_log("cannot load files lazily, _G already has an __index");
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  lua_pop(L, 1);
+  int metatable = lua_gettop(L);
+
+  lua_newtable(L); // global name -> file path
+  int index = lua_gettop(L);
+  lua_newtable(L); // file path -> index entry
+  int files = lua_gettop(L);
+  lua_newtable(L); // file paths that run at startup
+  int eager = lua_gettop(L);
+  lua_newtable(L); // saved index entries
+  int saved = lua_gettop(L);
+  eso_readlazyindex(L, saved);
+
+  bool changed = false;
+  int count = (int)lua_objlen(L, 1);
+  for (int i = 1; i <= count; ++i) {
+    lua_rawgeti(L, 1, i);
+    const char *filePath = luaL_checkstring(L, -1);
+    char *path = eso_resolvefilepath(filePath);
+    lua_pop(L, 1);
+    struct stat info;
+    if (path == NULL || !eso_isluafile(path) || stat(path, &info) != 0) {
+      eso_log("failed to index Lua file '%s'", path != NULL ? path : filePath);
+      free(path);
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+
+    lua_getfield(L, saved, path);
+    if (lua_istable(L, -1)) {
+      lua_getfield(L, -1, "mtime");
+      lua_getfield(L, -2, "size");
+      bool valid = lua_tonumber(L, -2) == (double)info.st_mtime &&
+                   lua_tonumber(L, -1) == (double)info.st_size;
+      lua_pop(L, 2);
+      if (!valid) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+      }
+    }
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      if (eso_loadluafile(L, path, NULL) != 0) {
+        eso_log("failed to index Lua file '%s'", path);
+        free(path);
+        lua_pushboolean(L, 0);
+        return 1;
+      }
+      eso_scanlazyfile(L, (double)info.st_mtime, (double)info.st_size);
+      lua_pushvalue(L, -1);
+      lua_setfield(L, saved, path);
+      changed = true;
+    }
+
+    // the first file defining a global wins; the others have to run in
+    // order, as does a file setting a global that exists already
+    lua_getfield(L, -1, "effects");
+    bool runsEagerly = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    int globals = (int)lua_objlen(L, -1);
+    for (int j = 1; j <= globals; ++j) {
+      lua_rawgeti(L, -1, j);
+      lua_pushvalue(L, -1);
+      lua_rawget(L, index);
+      bool defined = !lua_isnil(L, -1);
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_rawget(L, LUA_GLOBALSINDEX);
+      defined = defined || !lua_isnil(L, -1);
+      lua_pop(L, 1);
+      if (defined) {
+        runsEagerly = true;
+        lua_pop(L, 1);
+      } else {
+        lua_pushstring(L, path);
+        lua_rawset(L, index);
+      }
+    }
+    if (runsEagerly) {
+      lua_pushstring(L, path);
+      lua_rawseti(L, eager, (int)lua_objlen(L, eager) + 1);
+    }
+    lua_setfield(L, files, path);
+    free(path);
+  }
+
+  if (changed) {
+    eso_writelazyindex(L, saved);
+  }
+
+  lua_pushvalue(L, index);
+  lua_pushvalue(L, files);
+  lua_pushcclosure(L, eso_lazyindex, 2);
+  lua_setfield(L, metatable, "__index");
+  lua_pushvalue(L, metatable);
+  lua_setmetatable(L, LUA_GLOBALSINDEX);
+
+  // files that run eagerly first load the files that defined the globals
+  // they set, so they replace those definitions instead of being replaced
+  int eagerCount = (int)lua_objlen(L, eager);
+  for (int i = 1; i <= eagerCount; ++i) {
+    lua_rawgeti(L, eager, i);
+    const char *path = lua_tostring(L, -1);
+    lua_getfield(L, files, path);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 2); // an earlier file read one of its globals
+      continue;
+    }
+    int globals = (int)lua_objlen(L, -1);
+    for (int j = 1; j <= globals; ++j) {
+      lua_rawgeti(L, -1, j);
+      lua_pushvalue(L, -1);
+      lua_rawget(L, index);
+      bool other = lua_isstring(L, -1) && strcmp(lua_tostring(L, -1), path);
+      lua_pop(L, 1);
+      if (other) {
+        lua_gettable(L, LUA_GLOBALSINDEX);
+      }
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    if (eso_runlazyfile(L, index, files, path) != 0) {
+      eso_log("%s", lua_tostring(L, -1));
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+    lua_pop(L, 1);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
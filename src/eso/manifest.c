@@ -0,0 +1,591 @@
+#define ESO_MANIFEST_LANGUAGE "en"
+#define ESO_MANIFEST_APIVERSION "101037"
+#define ESO_MANIFEST_MAXDEPTH 3 // how deep addons can be nested in a folder
+
+// parsed manifests are kept for the lifetime of the process and only parsed
+// again when the file changes; file entries are stored as written and
+// variables like $(language) are substituted whenever the addon is loaded
+
+typedef struct eso_StringList {
+  char **items;
+  int count;
+  int capacity;
+} eso_StringList;
+
+typedef struct eso_Dependency {
+  char *name;
+  int minVersion;
+  bool optional;
+} eso_Dependency;
+
+typedef struct eso_Manifest {
+  char *path;
+  char *basepath;
+  char *name;
+  unsigned long long mtime;
+  unsigned long long size;
+  int addOnVersion;
+  eso_StringList files;
+  eso_StringList savedVariables;
+  eso_Dependency *dependencies;
+  int dependencyCount;
+  int dependencyCapacity;
+  struct eso_Manifest *next;
+} eso_Manifest;
+
+static eso_Manifest *eso_manifestcache = NULL;
+static eso_StringList eso_manifestvariables = {NULL, 0, 0}; // name, value, ...
+
+static bool eso_growarray(void **items, int *capacity, int count,
+                          size_t size) {
+  if (count < *capacity) {
+    return true;
+  }
+  int newCapacity = *capacity * 2 + 8;
+  void *newItems = realloc(*items, newCapacity * size);
+  if (newItems == NULL) {
+    return false;
+  }
+  *items = newItems;
+  *capacity = newCapacity;
+  return true;
+}
+
+static char *eso_copystring(const char *value, size_t length) {
+  char *result = malloc(length + 1);
+  if (result != NULL) {
+    memcpy(result, value, length);
+    result[length] = '\0';
+  }
+  return result;
+}
+
+static void eso_addstring(eso_StringList *list, const char *value,
+                          size_t length) {
+  if (eso_growarray((void **)&list->items, &list->capacity, list->count,
+                    sizeof(char *))) {
+    list->items[list->count++] = eso_copystring(value, length);
+  }
+}
+
+static void eso_freestrings(eso_StringList *list) {
+  for (int i = 0; i < list->count; ++i) {
+    free(list->items[i]);
+  }
+  free(list->items);
+}
+
+static void eso_freemanifest(eso_Manifest *manifest) {
+  for (int i = 0; i < manifest->dependencyCount; ++i) {
+    free(manifest->dependencies[i].name);
+  }
+  free(manifest->dependencies);
+  eso_freestrings(&manifest->files);
+  eso_freestrings(&manifest->savedVariables);
+  free(manifest->name);
+  free(manifest->basepath);
+  free(manifest->path);
+  free(manifest);
+}
+
+static bool eso_startswithignorecase(const char *value, const char *prefix) {
+  for (; *prefix != '\0'; ++value, ++prefix) {
+    if (tolower((unsigned char)*value) != tolower((unsigned char)*prefix)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool eso_endswithignorecase(const char *value, const char *suffix) {
+  size_t length = strlen(value);
+  size_t suffixLength = strlen(suffix);
+  return length >= suffixLength &&
+         eso_startswithignorecase(value + length - suffixLength, suffix);
+}
+
+static void eso_setmanifestvariable(const char *name, const char *value) {
+  for (int i = 0; i < eso_manifestvariables.count; i += 2) {
+    if (strcmp(eso_manifestvariables.items[i], name) == 0) {
+      free(eso_manifestvariables.items[i + 1]);
+      eso_manifestvariables.items[i + 1] = strdup(value);
+      return;
+    }
+  }
+  eso_addstring(&eso_manifestvariables, name, strlen(name));
+  eso_addstring(&eso_manifestvariables, value, strlen(value));
+}
+
+static const char *eso_getmanifestvariable(const char *name, size_t length) {
+  for (int i = 0; i < eso_manifestvariables.count; i += 2) {
+    const char *variable = eso_manifestvariables.items[i];
+    if (strlen(variable) == length && strncmp(variable, name, length) == 0) {
+      return eso_manifestvariables.items[i + 1];
+    }
+  }
+  if (length == 8 && strncmp(name, "language", length) == 0) {
+    return ESO_MANIFEST_LANGUAGE;
+  } else if (length == 10 && strncmp(name, "APIVersion", length) == 0) {
+    return ESO_MANIFEST_APIVERSION;
+  }
+  return NULL;
+}
+
+// replaces every known $(name) in the entry; unknown ones are kept as is
+static void eso_substitutemanifestvariables(luaL_Buffer *b,
+                                            const char *entry) {
+  const char *c = entry;
+  while (*c != '\0') {
+    const char *end;
+    const char *value = NULL;
+    if (c[0] == '$' && c[1] == '(' && (end = strchr(c + 2, ')')) != NULL) {
+      value = eso_getmanifestvariable(c + 2, end - c - 2);
+    }
+    if (value != NULL) {
+      luaL_addstring(b, value);
+      c = end + 1;
+    } else {
+      luaL_addchar(b, *c++);
+    }
+  }
+}
+
+// "LibA>=12 LibB" style lists as used by DependsOn and OptionalDependsOn
+static void eso_parsedependencies(eso_Manifest *manifest, const char *value,
+                                  bool optional) {
+  while (*value != '\0') {
+    while (isspace((unsigned char)*value)) {
+      value++;
+    }
+    const char *start = value;
+    while (*value != '\0' && !isspace((unsigned char)*value)) {
+      value++;
+    }
+    if (value == start ||
+        !eso_growarray((void **)&manifest->dependencies,
+                       &manifest->dependencyCapacity,
+                       manifest->dependencyCount, sizeof(eso_Dependency))) {
+      continue;
+    }
+
+    eso_Dependency *dependency =
+        &manifest->dependencies[manifest->dependencyCount++];
+    dependency->name = eso_copystring(start, value - start);
+    dependency->minVersion = 0;
+    dependency->optional = optional;
+    char *version = strstr(dependency->name, ">=");
+    if (version != NULL) {
+      dependency->minVersion = atoi(version + 2);
+      *version = '\0';
+    }
+  }
+}
+
+static void eso_parsewords(eso_StringList *list, const char *value) {
+  while (*value != '\0') {
+    while (isspace((unsigned char)*value)) {
+      value++;
+    }
+    const char *start = value;
+    while (*value != '\0' && !isspace((unsigned char)*value)) {
+      value++;
+    }
+    if (value > start) {
+      eso_addstring(list, start, value - start);
+    }
+  }
+}
+
+static void eso_parsemanifestdirective(eso_Manifest *manifest, char *line) {
+  char *value = strchr(line, ':');
+  if (value == NULL) {
+    return;
+  }
+  *value++ = '\0';
+
+  const char *key = line;
+  while (*key == '#' || isspace((unsigned char)*key)) {
+    key++;
+  }
+  if (eso_startswithignorecase(key, "DependsOn")) {
+    eso_parsedependencies(manifest, value, false);
+  } else if (eso_startswithignorecase(key, "OptionalDependsOn")) {
+    eso_parsedependencies(manifest, value, true);
+  } else if (eso_startswithignorecase(key, "SavedVariables")) {
+    eso_parsewords(&manifest->savedVariables, value);
+  } else if (eso_startswithignorecase(key, "AddOnVersion")) {
+    manifest->addOnVersion = atoi(value);
+  }
+}
+
+// the buffer has to be zero terminated and is modified while parsing
+static void eso_parsemanifest(eso_Manifest *manifest, char *data) {
+  char *line = data;
+  if (memcmp(line, "\xEF\xBB\xBF", 3) == 0) {
+    line += 3;
+  }
+  while (line != NULL) {
+    char *next = strchr(line, '\n');
+    if (next != NULL) {
+      *next++ = '\0';
+    }
+
+    char *end = line + strlen(line);
+    while (end > line && isspace((unsigned char)end[-1])) {
+      *--end = '\0';
+    }
+    while (isspace((unsigned char)*line)) {
+      line++;
+    }
+
+    if (line[0] == '#' && line[1] == '#') {
+      eso_parsemanifestdirective(manifest, line);
+    } else if (line[0] != '\0' && line[0] != '#' && line[0] != ';') {
+      for (char *c = line; *c != '\0'; ++c) {
+        if (*c == '\\') {
+          *c = '/';
+        }
+      }
+      eso_addstring(&manifest->files, line, strlen(line));
+    }
+    line = next;
+  }
+}
+
+static char *eso_getaddonname(const char *path) {
+  const char *name = strrchr(path, '/');
+  name = (name != NULL) ? name + 1 : path;
+  const char *extension = strrchr(name, '.');
+  return eso_copystring(name, extension != NULL ? (size_t)(extension - name)
+                                         : strlen(name));
+}
+
+// returns the parsed manifest for an absolute path, or NULL if unreadable
+static const eso_Manifest *eso_getmanifest(const char *path,
+                                           eso_Buffer *buffer) {
+  struct stat info;
+  if (stat(path, &info) != 0) {
+    return NULL;
+  }
+
+  eso_Manifest **link = &eso_manifestcache;
+  for (; *link != NULL; link = &(*link)->next) {
+    eso_Manifest *cached = *link;
+    if (strcmp(cached->path, path) != 0) {
+      continue;
+    }
+    if (cached->mtime == (unsigned long long)info.st_mtime &&
+        cached->size == (unsigned long long)info.st_size) {
+      return cached;
+    }
+    *link = cached->next; // changed on disk
+    eso_freemanifest(cached);
+    break;
+  }
+
+  eso_log("parse manifest file '%s'", path);
+  if (!eso_readfile(path, buffer) ||
+      eso_bufferwriter(NULL, "", 1, buffer) != 0) {
+    return NULL;
+  }
+
+  eso_Manifest *manifest = calloc(1, sizeof(eso_Manifest));
+  if (manifest == NULL) {
+    return NULL;
+  }
+  manifest->path = strdup(path);
+  manifest->basepath = eso_getbasepath(path);
+  manifest->name = eso_getaddonname(path);
+  manifest->mtime = (unsigned long long)info.st_mtime;
+  manifest->size = (unsigned long long)info.st_size;
+  eso_parsemanifest(manifest, buffer->data);
+
+  manifest->next = eso_manifestcache;
+  eso_manifestcache = manifest;
+  return manifest;
+}
+
+// pushes the full paths of the Lua files in load order as a table
+static void eso_pushmanifestfiles(lua_State *L, const eso_Manifest *manifest) {
+  lua_createtable(L, manifest->files.count, 0);
+  int count = 0;
+  for (int i = 0; i < manifest->files.count; ++i) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, manifest->basepath);
+    eso_substitutemanifestvariables(&b, manifest->files.items[i]);
+    luaL_pushresult(&b);
+
+    const char *file = lua_tostring(L, -1);
+    if (eso_isluafile(file)) {
+      lua_rawseti(L, -2, ++count);
+    } else {
+      if (eso_endswithignorecase(file, ".xml")) {
+        eso_log("skip xml file '%s'", file);
+      }
+      lua_pop(L, 1);
+    }
+  }
+}
+
+static bool eso_loadmanifest(lua_State *L, const eso_Manifest *manifest) {
+  eso_pushmanifestfiles(L, manifest);
+  int count = (int)lua_objlen(L, -1);
+  const char *files[count > 0 ? count : 1];
+  for (int i = 0; i < count; ++i) {
+    lua_rawgeti(L, -1, i + 1);
+    files[i] = lua_tostring(L, -1); // kept alive by the table
+    lua_pop(L, 1);
+  }
+
+  bool success = eso_loadluafiles(L, files, count);
+  lua_pop(L, 1);
+  return success;
+}
+
+typedef struct eso_ManifestList {
+  const eso_Manifest **items;
+  int count;
+  int capacity;
+} eso_ManifestList;
+
+static void eso_addmanifest(eso_ManifestList *list,
+                            const eso_Manifest *manifest) {
+  if (eso_growarray((void **)&list->items, &list->capacity, list->count,
+                    sizeof(eso_Manifest *))) {
+    list->items[list->count++] = manifest;
+  }
+}
+
+static int eso_comparenames(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool eso_isdirectory(const char *path) {
+  struct stat info;
+  return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+// looks for X/X.addon or X/X.txt in every folder below the path, including
+// libraries nested inside other addons; folders are visited in sorted order
+// so the discovered order does not depend on the file system
+static void eso_findmanifests(eso_ManifestList *list, char *path,
+                              size_t length, int depth,
+                              eso_Buffer *buffer) {
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return;
+  }
+
+  eso_StringList names = {NULL, 0, 0};
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') { // also skips hidden folders like .git
+      eso_addstring(&names, entry->d_name, strlen(entry->d_name));
+    }
+  }
+  closedir(dir);
+  qsort(names.items, names.count, sizeof(char *), eso_comparenames);
+
+  for (int i = 0; i < names.count; ++i) {
+    const char *name = names.items[i];
+    size_t nameLength = strlen(name);
+    // room for "/name/name.addon"
+    if (length + 2 * nameLength + sizeof("//.addon") > PATH_MAX) {
+      continue;
+    }
+    sprintf(path + length, "/%s", name);
+    size_t folderLength = length + 1 + nameLength;
+    if (!eso_isdirectory(path)) {
+      continue;
+    }
+
+    sprintf(path + folderLength, "/%s.addon", name);
+    const eso_Manifest *manifest = eso_getmanifest(path, buffer);
+    if (manifest == NULL) {
+      sprintf(path + folderLength, "/%s.txt", name);
+      manifest = eso_getmanifest(path, buffer);
+    }
+    if (manifest != NULL) {
+      eso_addmanifest(list, manifest);
+    }
+
+    path[folderLength] = '\0';
+    if (depth < ESO_MANIFEST_MAXDEPTH) {
+      eso_findmanifests(list, path, folderLength, depth + 1, buffer);
+    }
+  }
+  path[length] = '\0';
+  eso_freestrings(&names);
+}
+
+enum eso_AddonState {
+  ESO_ADDON_NEW,
+  ESO_ADDON_VISITING,
+  ESO_ADDON_ORDERED,
+  ESO_ADDON_FAILED
+};
+
+typedef struct eso_Addon {
+  const eso_Manifest *manifest;
+  int state;
+  int order;
+  bool loaded;
+  double time;
+  const char *error;
+} eso_Addon;
+
+typedef struct eso_AddonGraph {
+  lua_State *L;
+  eso_Addon *addons;
+  int count;
+  int names; // stack index: addon name -> index
+  int *order;
+  int orderCount;
+} eso_AddonGraph;
+
+static int eso_findaddon(eso_AddonGraph *G, const char *name) {
+  lua_getfield(G->L, G->names, name);
+  int index = lua_isnil(G->L, -1) ? -1 : (int)lua_tointeger(G->L, -1);
+  lua_pop(G->L, 1);
+  return index;
+}
+
+static bool eso_failaddon(eso_AddonGraph *G, eso_Addon *addon,
+                          const char *format, const char *name) {
+  addon->state = ESO_ADDON_FAILED;
+  addon->error = lua_pushfstring(G->L, format, name);
+  lua_rawseti(G->L, G->names, -(int)(addon - G->addons) - 1); // keep alive
+  eso_log("cannot load addon '%s': %s", addon->manifest->name, addon->error);
+  return false;
+}
+
+// depth first search that appends each addon after all its dependencies
+static bool eso_orderaddon(eso_AddonGraph *G, int index) {
+  eso_Addon *addon = &G->addons[index];
+  if (addon->state == ESO_ADDON_ORDERED) {
+    return true;
+  } else if (addon->state == ESO_ADDON_FAILED) {
+    return false;
+  } else if (addon->state == ESO_ADDON_VISITING) {
+    return eso_failaddon(G, addon, "circular dependency on %s",
+                         addon->manifest->name);
+  }
+
+  addon->state = ESO_ADDON_VISITING;
+  const eso_Manifest *manifest = addon->manifest;
+  for (int i = 0; i < manifest->dependencyCount; ++i) {
+    const eso_Dependency *dependency = &manifest->dependencies[i];
+    int other = eso_findaddon(G, dependency->name);
+    if (other < 0) {
+      if (dependency->optional) {
+        continue;
+      }
+      return eso_failaddon(G, addon, "missing dependency %s",
+                           dependency->name);
+    }
+    if (G->addons[other].manifest->addOnVersion < dependency->minVersion &&
+        !dependency->optional) {
+      return eso_failaddon(G, addon, "outdated dependency %s",
+                           dependency->name);
+    }
+    if (!eso_orderaddon(G, other) && !dependency->optional) {
+      if (addon->state == ESO_ADDON_FAILED) { // part of the reported cycle
+        return false;
+      }
+      return eso_failaddon(G, addon, "dependency %s failed",
+                           dependency->name);
+    }
+  }
+
+  addon->state = ESO_ADDON_ORDERED;
+  addon->order = ++G->orderCount;
+  G->order[G->orderCount - 1] = index;
+  return true;
+}
+
+static void eso_pushaddonresult(lua_State *L, const eso_Addon *addon) {
+  const eso_Manifest *manifest = addon->manifest;
+  lua_createtable(L, 0, 7);
+  lua_pushstring(L, manifest->name);
+  lua_setfield(L, -2, "name");
+  lua_pushstring(L, manifest->path);
+  lua_setfield(L, -2, "path");
+  lua_pushboolean(L, addon->loaded);
+  lua_setfield(L, -2, "success");
+  if (addon->order > 0) {
+    lua_pushinteger(L, addon->order);
+    lua_setfield(L, -2, "order");
+    lua_pushnumber(L, addon->time);
+    lua_setfield(L, -2, "time");
+  }
+  if (addon->error != NULL) {
+    lua_pushstring(L, addon->error);
+    lua_setfield(L, -2, "error");
+  }
+  lua_createtable(L, manifest->savedVariables.count, 0);
+  for (int i = 0; i < manifest->savedVariables.count; ++i) {
+    lua_pushstring(L, manifest->savedVariables.items[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "savedVariables");
+}
+
+// loads the addons in dependency order and pushes a table with a result for
+// each of them, in the order they were passed
+static void eso_loadaddons(lua_State *L, const eso_Manifest **manifests,
+                           int count) {
+  eso_AddonGraph G;
+  G.L = L;
+  G.count = count;
+  G.orderCount = 0;
+  G.addons = calloc(count > 0 ? count : 1, sizeof(eso_Addon));
+  G.order = calloc(count > 0 ? count : 1, sizeof(int));
+  if (G.addons == NULL || G.order == NULL) {
+    free(G.addons);
+    free(G.order);
+    luaL_error(L, "not enough memory");
+  }
+
+  lua_newtable(L);
+  G.names = lua_gettop(L);
+  for (int i = 0; i < count; ++i) {
+    G.addons[i].manifest = manifests[i];
+    lua_getfield(L, G.names, manifests[i]->name);
+    int other = lua_isnil(L, -1) ? -1 : (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    // like the game, only the copy with the highest AddOnVersion is loaded
+    if (other >= 0 &&
+        manifests[other]->addOnVersion >= manifests[i]->addOnVersion) {
+      eso_failaddon(&G, &G.addons[i], "duplicate addon %s",
+                    manifests[i]->name);
+      continue;
+    } else if (other >= 0) {
+      eso_failaddon(&G, &G.addons[other], "duplicate addon %s",
+                    manifests[other]->name);
+    }
+    lua_pushinteger(L, i);
+    lua_setfield(L, G.names, manifests[i]->name);
+  }
+
+  for (int i = 0; i < count; ++i) {
+    eso_orderaddon(&G, i);
+  }
+
+  for (int i = 0; i < G.orderCount; ++i) {
+    eso_Addon *addon = &G.addons[G.order[i]];
+    eso_log("load addon '%s'", addon->manifest->name);
+    double start = eso_getclock();
+    addon->loaded = eso_loadmanifest(L, addon->manifest);
+    addon->time = eso_getclock() - start;
+  }
+
+  lua_createtable(L, count, 0);
+  for (int i = 0; i < count; ++i) {
+    eso_pushaddonresult(L, &G.addons[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_remove(L, G.names);
+  free(G.order);
+  free(G.addons);
+}
@@ -0,0 +1,293 @@
+#define ESO_FRAME_MS (1000.0 / 60)
+#define ESO_WORSTFRAMES 5
+#define ESO_WORSTNAMESPACES 5
+
+// while handler stats are enabled, every event handler and update call is
+// timed and its time and allocations are added to the totals of its
+// namespace; while frames are profiled they are also attributed to the
+// current frame, which is only kept if it is one of the slowest
+
+typedef struct eso_HandlerStats {
+  char *name;
+  double time;
+  size_t allocated;
+  int calls;
+  double maxTime;
+  int overBudget; // frames in which the namespace took longer than the budget
+  double frameTime;
+  size_t frameAllocated;
+  bool inFrame;
+} eso_HandlerStats;
+
+typedef struct eso_NamespaceTime {
+  const char *name; // owned by the handler stats
+  double time;
+  size_t allocated;
+  int calls;
+} eso_NamespaceTime;
+
+typedef struct eso_FrameProfile {
+  int frame;
+  double time;
+  size_t allocated;
+  size_t freed;
+  eso_NamespaceTime *namespaces;
+  int count;
+  int capacity;
+} eso_FrameProfile;
+
+typedef struct eso_HandlerCall {
+  double start;
+  size_t allocated;
+} eso_HandlerCall;
+
+static eso_HandlerStats *eso_handlerstats = NULL;
+static int eso_handlerstatcount = 0;
+static int eso_handlerstatcapacity = 0;
+static int *eso_framehandlers = NULL; // stats used in the current frame
+static int eso_framehandlercount = 0;
+static int eso_framehandlercapacity = 0;
+static bool eso_handlerstatsenabled = false;
+static double eso_handlerbudget = 0; // per namespace and frame, 0 for none
+static double eso_frametime = 0;
+static bool eso_profilingframes = false;
+static eso_FrameProfile eso_currentframe;
+
+// returns the stats for the namespace at idx, which are kept for the whole
+// session so they do not start over when a handler is registered again
+static int eso_gethandlerstats(lua_State *L, int idx) {
+  const char *name = lua_tostring(L, idx);
+  for (int i = 0; i < eso_handlerstatcount; ++i) {
+    if (strcmp(eso_handlerstats[i].name, name) == 0) {
+      return i;
+    }
+  }
+  if (!eso_growarray((void **)&eso_handlerstats, &eso_handlerstatcapacity,
+                     eso_handlerstatcount, sizeof(eso_HandlerStats)) ||
+      !eso_growarray((void **)&eso_framehandlers, &eso_framehandlercapacity,
+                     eso_handlerstatcount, sizeof(int))) {
+    luaL_error(L, "not enough memory");
+  }
+  eso_HandlerStats *stats = &eso_handlerstats[eso_handlerstatcount];
+  memset(stats, 0, sizeof(eso_HandlerStats));
+  stats->name = eso_copystring(name, strlen(name));
+  if (stats->name == NULL) {
+    luaL_error(L, "not enough memory");
+  }
+  return eso_handlerstatcount++;
+}
+
+static void eso_beginhandler(lua_State *L, eso_HandlerCall *call) {
+  if (!eso_handlerstatsenabled && !eso_profilingframes) {
+    call->start = -1;
+    return;
+  }
+  call->start = eso_getclock();
+  call->allocated = eso_getallocatedbytes(L);
+}
+
+static void eso_endhandler(lua_State *L, int id, const eso_HandlerCall *call) {
+  if (call->start < 0) {
+    return;
+  }
+  double time = eso_getclock() - call->start;
+  size_t allocated = eso_getallocatedbytes(L) - call->allocated;
+  eso_HandlerStats *stats = &eso_handlerstats[id];
+  stats->time += time;
+  stats->allocated += allocated;
+  stats->calls++;
+  if (time > stats->maxTime) {
+    stats->maxTime = time;
+  }
+  if (!stats->inFrame) {
+    stats->inFrame = true;
+    eso_framehandlers[eso_framehandlercount++] = id;
+  }
+  stats->frameTime += time;
+  stats->frameAllocated += allocated;
+
+  if (!eso_profilingframes) {
+    return;
+  }
+  eso_FrameProfile *frame = &eso_currentframe;
+  int i = 0;
+  while (i < frame->count && frame->namespaces[i].name != stats->name) {
+    i++;
+  }
+  if (i == frame->count) {
+    if (!eso_growarray((void **)&frame->namespaces, &frame->capacity,
+                       frame->count, sizeof(eso_NamespaceTime))) {
+      return;
+    }
+    eso_NamespaceTime *entry = &frame->namespaces[frame->count++];
+    memset(entry, 0, sizeof(eso_NamespaceTime));
+    entry->name = stats->name;
+  }
+  frame->namespaces[i].time += time;
+  frame->namespaces[i].allocated += allocated;
+  frame->namespaces[i].calls++;
+}
+
+// reports the namespaces that went over the budget in the frame that just
+// ended, like the performance warnings of the game
+static void eso_endhandlerframe() {
+  for (int i = 0; i < eso_framehandlercount; ++i) {
+    eso_HandlerStats *stats = &eso_handlerstats[eso_framehandlers[i]];
+    if (eso_handlerbudget > 0 && stats->frameTime > eso_handlerbudget) {
+      stats->overBudget++;
+      printf("%s took %.2fms and allocated %lu bytes in one frame, which is "
+             "over the budget of %.2fms\n",
+             stats->name, stats->frameTime,
+             (unsigned long)stats->frameAllocated, eso_handlerbudget);
+    }
+    stats->frameTime = 0;
+    stats->frameAllocated = 0;
+    stats->inFrame = false;
+  }
+  eso_framehandlercount = 0;
+}
+
+// eso.EnableHandlerStats(enable[, budgetMs]) where the budget is optional
+// and reports every namespace that takes longer within a single frame; the
+// timing costs about as much as an empty handler, so it is off by default
+static int esoL_enablehandlerstats(lua_State *L) {
+  eso_handlerstatsenabled = lua_toboolean(L, 1);
+  eso_handlerbudget = luaL_optnumber(L, 2, 0);
+  return 0;
+}
+
+static int eso_comparehandlerstats(const void *a, const void *b) {
+  double x = eso_handlerstats[*(const int *)a].time;
+  double y = eso_handlerstats[*(const int *)b].time;
+  return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+// returns the totals of every namespace, from the slowest to the fastest
+static int esoL_gethandlerstats(lua_State *L) {
+  int *order = malloc((eso_handlerstatcount + 1) * sizeof(int));
+  if (order == NULL) {
+    return luaL_error(L, "not enough memory");
+  }
+  for (int i = 0; i < eso_handlerstatcount; ++i) {
+    order[i] = i;
+  }
+  qsort(order, eso_handlerstatcount, sizeof(int), eso_comparehandlerstats);
+
+  lua_createtable(L, eso_handlerstatcount, 0);
+  for (int i = 0; i < eso_handlerstatcount; ++i) {
+    const eso_HandlerStats *stats = &eso_handlerstats[order[i]];
+    lua_createtable(L, 0, 6);
+    lua_pushstring(L, stats->name);
+    lua_setfield(L, -2, "name");
+    lua_pushnumber(L, stats->time);
+    lua_setfield(L, -2, "time");
+    lua_pushnumber(L, stats->allocated);
+    lua_setfield(L, -2, "allocated");
+    lua_pushinteger(L, stats->calls);
+    lua_setfield(L, -2, "calls");
+    lua_pushnumber(L, stats->maxTime);
+    lua_setfield(L, -2, "maxTime");
+    lua_pushinteger(L, stats->overBudget);
+    lua_setfield(L, -2, "overBudget");
+    lua_rawseti(L, -2, i + 1);
+  }
+  free(order);
+  return 1;
+}
+
+static void eso_clearframeprofile(eso_FrameProfile *frame) {
+  frame->count = 0;
+}
+
+static int eso_comparenamespacetimes(const void *a, const void *b) {
+  double x = ((const eso_NamespaceTime *)a)->time;
+  double y = ((const eso_NamespaceTime *)b)->time;
+  return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+// keeps the current frame if it is one of the slowest so far, sorted from
+// slowest to fastest, and starts a new one
+static void eso_keepframeprofile(eso_FrameProfile *worst, int *worstCount) {
+  eso_FrameProfile *frame = &eso_currentframe;
+  int index = *worstCount;
+  while (index > 0 && worst[index - 1].time < frame->time) {
+    index--;
+  }
+  if (index == ESO_WORSTFRAMES) {
+    eso_clearframeprofile(frame);
+    return;
+  }
+
+  eso_FrameProfile dropped = {0};
+  if (*worstCount == ESO_WORSTFRAMES) {
+    dropped = worst[ESO_WORSTFRAMES - 1];
+  } else {
+    (*worstCount)++;
+  }
+  memmove(&worst[index + 1], &worst[index],
+          (*worstCount - index - 1) * sizeof(eso_FrameProfile));
+  qsort(frame->namespaces, frame->count, sizeof(eso_NamespaceTime),
+        eso_comparenamespacetimes);
+  worst[index] = *frame;
+
+  // reuse the storage of the dropped frame for the next one
+  eso_clearframeprofile(&dropped);
+  memset(frame, 0, sizeof(eso_FrameProfile));
+  frame->namespaces = dropped.namespaces;
+  frame->capacity = dropped.capacity;
+}
+
+static void eso_pushpercentiles(lua_State *L, double *values, int count,
+                                double total) {
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, total);
+  lua_setfield(L, -2, "total");
+  if (count == 0) {
+    return;
+  }
+  static const struct {
+    const char *name;
+    double rank;
+  } percentiles[] = {{"p50", 0.5}, {"p95", 0.95}, {"p99", 0.99}, {"max", 1}};
+  for (int i = 0; i < 4; ++i) {
+    int index = (int)(percentiles[i].rank * count + 0.999999) - 1;
+    lua_pushnumber(L, values[index < 0 ? 0 : index]);
+    lua_setfield(L, -2, percentiles[i].name);
+  }
+}
+
+static int eso_comparenumbers(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void eso_pushframeprofile(lua_State *L, const eso_FrameProfile *frame) {
+  lua_createtable(L, 0, 5);
+  lua_pushinteger(L, frame->frame);
+  lua_setfield(L, -2, "frame");
+  lua_pushnumber(L, frame->time);
+  lua_setfield(L, -2, "time");
+  lua_pushnumber(L, frame->allocated);
+  lua_setfield(L, -2, "allocated");
+  lua_pushnumber(L, frame->freed);
+  lua_setfield(L, -2, "freed");
+
+  int count = frame->count < ESO_WORSTNAMESPACES ? frame->count
+                                                  : ESO_WORSTNAMESPACES;
+  lua_createtable(L, count, 0);
+  for (int i = 0; i < count; ++i) {
+    const eso_NamespaceTime *entry = &frame->namespaces[i];
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, entry->name);
+    lua_setfield(L, -2, "name");
+    lua_pushnumber(L, entry->time);
+    lua_setfield(L, -2, "time");
+    lua_pushnumber(L, entry->allocated);
+    lua_setfield(L, -2, "allocated");
+    lua_pushinteger(L, entry->calls);
+    lua_setfield(L, -2, "calls");
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "namespaces");
+}
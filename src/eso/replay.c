@@ -0,0 +1,319 @@
+#define ESO_REPLAY_CHUNK 65536
+
+// a trace has one event per line: the time in milliseconds, the event and its
+// arguments, separated by tabs; arguments are decimal or hex numbers, true,
+// false, nil or strings, which can be quoted with " to keep them from being
+// read as one of the others and use \t, \n and \\ as escapes; empty lines and
+// lines starting with # are skipped
+//
+// the trace is read in chunks and the events are triggered in frames of
+// ESO_FRAME_MS at the time they were recorded, relative to the first one
+
+typedef struct eso_TraceReader {
+  FILE *fp;
+  char *data;
+  size_t size;
+  size_t capacity;
+  size_t position;
+  int line;
+  bool outOfMemory;
+} eso_TraceReader;
+
+// runs in a protected call, so the reader is always released
+typedef struct eso_Replay {
+  eso_TraceReader reader;
+  const char *path;
+  int events;
+  int frames;
+  double traceTime;
+} eso_Replay;
+
+// returns the next line without its line break, or NULL at the end
+static char *eso_readtraceline(eso_TraceReader *reader, size_t *length) {
+  for (;;) {
+    char *start = reader->data + reader->position;
+    char *end = memchr(start, '\n', reader->size - reader->position);
+    if (end != NULL || (feof(reader->fp) && reader->position < reader->size)) {
+      if (end == NULL) {
+        end = reader->data + reader->size;
+      }
+      bool lineBreak = end < reader->data + reader->size;
+      reader->position = end - reader->data + lineBreak;
+      *length = end - start;
+      if (*length > 0 && start[*length - 1] == '\r') {
+        (*length)--;
+      }
+      start[*length] = '\0';
+      reader->line++;
+      return start;
+    }
+    if (feof(reader->fp) || ferror(reader->fp)) {
+      return NULL;
+    }
+
+    // keep the incomplete line and read more after it
+    reader->size -= reader->position;
+    memmove(reader->data, reader->data + reader->position, reader->size);
+    reader->position = 0;
+    if (reader->capacity - reader->size < ESO_REPLAY_CHUNK) {
+      size_t capacity = reader->capacity * 2;
+      char *data = realloc(reader->data, capacity + 1);
+      if (data == NULL) {
+        reader->outOfMemory = true;
+        return NULL;
+      }
+      reader->data = data;
+      reader->capacity = capacity;
+    }
+    reader->size += fread(reader->data + reader->size, 1,
+                          reader->capacity - reader->size, reader->fp);
+  }
+}
+
+// only plain decimal numbers and integers in hex are numbers; strtod would
+// also take inf, nan, hex fractions and leading spaces
+static bool eso_istracenumber(const char *value, size_t length) {
+  size_t i = *value == '-';
+  size_t digits = 0;
+  while (i < length && isdigit((unsigned char)value[i])) {
+    i++;
+    digits++;
+  }
+  if (i < length && value[i] == '.') {
+    for (i++; i < length && isdigit((unsigned char)value[i]); ++i) {
+      digits++;
+    }
+  }
+  if (digits > 0 && i < length && (value[i] == 'e' || value[i] == 'E')) {
+    i++;
+    if (i < length && (value[i] == '+' || value[i] == '-')) {
+      i++;
+    }
+    size_t exponent = i;
+    while (i < length && isdigit((unsigned char)value[i])) {
+      i++;
+    }
+    if (i == exponent) {
+      return false;
+    }
+  }
+  return digits > 0 && i == length;
+}
+
+// pushes the field that starts at value and returns where the next one starts
+static char *eso_pushtracefield(lua_State *L, char *value) {
+  char *end = strchr(value, '\t');
+  if (end == NULL) {
+    end = value + strlen(value);
+  }
+  char *next = *end == '\0' ? end : end + 1;
+  size_t length = end - value;
+
+  if (*value == '"') {
+    value++;
+    length = length > 1 && end[-1] == '"' ? length - 2 : length - 1;
+  } else if (length == 4 && memcmp(value, "true", 4) == 0) {
+    lua_pushboolean(L, 1);
+    return next;
+  } else if (length == 5 && memcmp(value, "false", 5) == 0) {
+    lua_pushboolean(L, 0);
+    return next;
+  } else if (length == 3 && memcmp(value, "nil", 3) == 0) {
+    lua_pushnil(L);
+    return next;
+  } else if (length > 0) {
+    // most arguments are small integers, which do not need strtod
+    bool negative = *value == '-';
+    size_t i = negative;
+    lua_Number number = 0;
+    while (i < length && i < 16 && value[i] >= '0' && value[i] <= '9') {
+      number = number * 10 + (value[i++] - '0');
+    }
+    if (i == length && i > (size_t)negative) {
+      lua_pushnumber(L, negative ? -number : number);
+      return next;
+    }
+    if (length > (size_t)negative + 2 && value[negative] == '0' &&
+        (value[negative + 1] == 'x' || value[negative + 1] == 'X')) {
+      number = 0;
+      for (i = negative + 2; i < length && isxdigit((unsigned char)value[i]);
+           ++i) {
+        int digit = value[i];
+        number = number * 16 +
+                 (isdigit(digit) ? digit - '0' : tolower(digit) - 'a' + 10);
+      }
+      if (i == length) {
+        lua_pushnumber(L, negative ? -number : number);
+        return next;
+      }
+    } else if (eso_istracenumber(value, length)) {
+      lua_pushnumber(L, lua_str2number(value, NULL));
+      return next;
+    }
+  }
+
+  // decode the escapes in place, they only ever get shorter
+  char *out = value;
+  for (size_t i = 0; i < length; ++i) {
+    char c = value[i];
+    if (c == '\\' && i + 1 < length) {
+      c = value[++i];
+      c = c == 't' ? '\t' : (c == 'n' ? '\n' : c);
+    }
+    *out++ = c;
+  }
+  lua_pushlstring(L, value, out - value);
+  return next;
+}
+
+// waits until the game time has reached the end of the frame and runs it
+// with the function at frameFn; errors are left on the stack
+static bool eso_runreplayframe(lua_State *L, int frameFn, double frameEnd) {
+  if (eso_virtualclock) {
+    if (frameEnd > eso_virtualtime) {
+      eso_virtualtime = frameEnd;
+    }
+  } else {
+    double delay = frameEnd - eso_getgametimemilliseconds(false);
+    if (delay > 0) {
+      usleep(delay * 1000);
+    }
+  }
+  lua_pushvalue(L, frameFn);
+  return lua_pcall(L, 0, 0, 0) == 0;
+}
+
+static int eso_replayevents_p(lua_State *L) {
+  eso_Replay *replay = (eso_Replay *)lua_touserdata(L, 1);
+  eso_TraceReader *reader = &replay->reader;
+  lua_pushcfunction(L, esoL_runframe);
+  int frameFn = lua_gettop(L);
+  double start = eso_getgametimemilliseconds(false);
+  double traceStart = 0;
+  long frame = 0;
+  const char *error = NULL;
+
+  size_t length;
+  char *line;
+  while (error == NULL && (line = eso_readtraceline(reader, &length))) {
+    if (length == 0 || *line == '#') {
+      continue;
+    }
+
+    char *end;
+    double time = lua_str2number(line, &end);
+    if (end == line || *end != '\t' || end[1] == '\0') {
+      error = "expected a time and an event";
+      break;
+    }
+    if (replay->events == 0) {
+      traceStart = time;
+    }
+    replay->traceTime = time - traceStart;
+
+    // finish the frames before the one the event was recorded in, including
+    // those with updates that are due in between
+    long eventFrame = (long)(replay->traceTime / ESO_FRAME_MS);
+    while (frame < eventFrame) {
+      if (eso_eventqueues[eso_activeeventqueue].count == 0) {
+        long updateFrame = eventFrame;
+        if (eso_updateheapsize > 0) {
+          double next = eso_updates[eso_updateheap[0]].time - start;
+          updateFrame = next < 0 ? frame : (long)(next / ESO_FRAME_MS);
+        }
+        if (updateFrame >= eventFrame) {
+          frame = eventFrame;
+          break;
+        }
+        if (updateFrame > frame) {
+          frame = updateFrame;
+        }
+      }
+      if (!eso_runreplayframe(L, frameFn,
+                              start + (frame + 1) * ESO_FRAME_MS)) {
+        error = lua_tostring(L, -1);
+        break;
+      }
+      replay->frames++;
+      frame++;
+    }
+    if (error != NULL) {
+      break;
+    }
+
+    int base = lua_gettop(L) + 1;
+    char *field = end + 1;
+    while (*field != '\0' && lua_checkstack(L, 1)) {
+      field = eso_pushtracefield(L, field);
+    }
+    if (*field != '\0') {
+      lua_settop(L, base - 1);
+      error = "too many arguments for event";
+      break;
+    }
+    eso_triggerevent(L, base);
+    replay->events++;
+  }
+  if (error == NULL && reader->outOfMemory) {
+    error = "not enough memory";
+  } else if (error == NULL && ferror(reader->fp)) {
+    error = "cannot read trace";
+  }
+  if (error == NULL && eso_eventqueues[eso_activeeventqueue].count > 0) {
+    if (!eso_runreplayframe(L, frameFn, start + (frame + 1) * ESO_FRAME_MS)) {
+      error = lua_tostring(L, -1);
+    } else {
+      replay->frames++;
+    }
+  }
+  if (error != NULL) {
+    return luaL_error(L, "%s:%d: %s", replay->path, reader->line, error);
+  }
+  return 0;
+}
+
+// eso.ReplayEvents(path[, mode]) with mode "max" (the default) to replay as
+// fast as possible on the virtual clock, which is switched on for the replay
+// like for RunFrames, or "realtime" to wait for the recorded time between
+// frames
+static int esoL_replayevents(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  static const char *const modes[] = {"max", "realtime", NULL};
+  bool realtime = luaL_checkoption(L, 2, "max", modes) == 1;
+
+  eso_Replay replay;
+  memset(&replay, 0, sizeof(eso_Replay));
+  replay.path = path;
+  replay.reader.capacity = ESO_REPLAY_CHUNK;
+  replay.reader.fp = fopen(path, "rb");
+  if (replay.reader.fp == NULL) {
+    return luaL_error(L, "cannot open trace %s", path);
+  }
+  replay.reader.data = malloc(replay.reader.capacity + 1);
+  if (replay.reader.data == NULL) {
+    fclose(replay.reader.fp);
+    return luaL_error(L, "not enough memory");
+  }
+
+  bool wasVirtual = realtime ? eso_virtualclock : eso_beginvirtualclock();
+  eso_log("Replay events from %s", path);
+  double wallStart = eso_getclock();
+  int status = lua_cpcall(L, eso_replayevents_p, &replay);
+  fclose(replay.reader.fp);
+  free(replay.reader.data);
+  eso_endvirtualclock(wasVirtual);
+  if (status != 0) {
+    return lua_error(L);
+  }
+
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, replay.events);
+  lua_setfield(L, -2, "events");
+  lua_pushinteger(L, replay.frames);
+  lua_setfield(L, -2, "frames");
+  lua_pushnumber(L, replay.traceTime);
+  lua_setfield(L, -2, "duration");
+  lua_pushnumber(L, eso_getclock() - wallStart);
+  lua_setfield(L, -2, "time");
+  return 1;
+}
@@ -0,0 +1,140 @@
+// load statistics record how long reading, parsing and running each file took
+// and how many bytes the Lua allocator handed out while parsing and running it
+
+typedef struct eso_AllocCounter {
+  lua_Alloc f;
+  void *ud;
+  size_t bytes;
+  size_t freed;
+} eso_AllocCounter;
+
+typedef struct eso_LoadRecord {
+  char *path;
+  size_t size;
+  bool cached;
+  double readTime;
+  double parseTime;
+  double execTime;
+  size_t parseBytes;
+  size_t execBytes;
+} eso_LoadRecord;
+
+static eso_AllocCounter eso_mainalloccounter = {NULL, NULL, 0, 0};
+static eso_LoadRecord *eso_loadrecords = NULL;
+static int eso_loadrecordcount = 0;
+static int eso_loadrecordcapacity = 0;
+
+// milliseconds from a monotonic clock where available
+static double eso_getclock() {
+#if defined(_WIN32)
+  static double frequency = 0;
+  LARGE_INTEGER now;
+  if (frequency == 0) {
+    LARGE_INTEGER ticks;
+    QueryPerformanceFrequency(&ticks);
+    frequency = (double)ticks.QuadPart / 1000.0;
+  }
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart / frequency;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+#else
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+#endif
+}
+
+static void *eso_countingalloc(void *ud, void *ptr, size_t osize,
+                               size_t nsize) {
+  eso_AllocCounter *counter = (eso_AllocCounter *)ud;
+  if (nsize > osize) {
+    counter->bytes += nsize - osize;
+  } else {
+    counter->freed += osize - nsize;
+  }
+  return counter->f(counter->ud, ptr, osize, nsize);
+}
+
+static void eso_countallocations(lua_State *L, eso_AllocCounter *counter) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  if (f != eso_countingalloc) {
+    counter->f = f;
+    counter->ud = ud;
+    counter->bytes = 0;
+    counter->freed = 0;
+    lua_setallocf(L, eso_countingalloc, counter);
+  }
+}
+
+static size_t eso_getallocatedbytes(lua_State *L) {
+  void *ud;
+  if (lua_getallocf(L, &ud) != eso_countingalloc) {
+    return 0;
+  }
+  return ((eso_AllocCounter *)ud)->bytes;
+}
+
+static size_t eso_getfreedbytes(lua_State *L) {
+  void *ud;
+  if (lua_getallocf(L, &ud) != eso_countingalloc) {
+    return 0;
+  }
+  return ((eso_AllocCounter *)ud)->freed;
+}
+
+// takes ownership of the record's path
+static void eso_addloadrecord(const eso_LoadRecord *record) {
+  if (eso_loadrecordcount == eso_loadrecordcapacity) {
+    int capacity = eso_loadrecordcapacity * 2 + 64;
+    eso_LoadRecord *records =
+        realloc(eso_loadrecords, capacity * sizeof(eso_LoadRecord));
+    if (records == NULL) {
+      free(record->path);
+      return;
+    }
+    eso_loadrecords = records;
+    eso_loadrecordcapacity = capacity;
+  }
+  eso_loadrecords[eso_loadrecordcount++] = *record;
+}
+
+static void eso_writejsonstring(FILE *fp, const char *value) {
+  fputc('"', fp);
+  for (const char *c = value; *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(fp, "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(fp, "\\u%04x", (unsigned char)*c);
+    } else {
+      fputc(*c, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+LUA_API int eso_write_load_stats(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    return 1;
+  }
+
+  fprintf(fp, "[");
+  for (int i = 0; i < eso_loadrecordcount; ++i) {
+    const eso_LoadRecord *record = &eso_loadrecords[i];
+    fprintf(fp, "%s\n  {\"file\": ", i > 0 ? "," : "");
+    eso_writejsonstring(fp, record->path);
+    fprintf(fp,
+            ", \"size\": %lu, \"cached\": %s, \"readTime\": %.3f, "
+            "\"parseTime\": %.3f, \"execTime\": %.3f, \"parseBytes\": %lu, "
+            "\"execBytes\": %lu}",
+            (unsigned long)record->size, record->cached ? "true" : "false",
+            record->readTime, record->parseTime, record->execTime,
+            (unsigned long)record->parseBytes, (unsigned long)record->execBytes);
+  }
+  fprintf(fp, "\n]\n");
+  return fclose(fp) != 0;
+}
@@ -0,0 +1,132 @@
+#define ESO_TASK_BUDGET (ESO_FRAME_MS / 4)
+
+// tasks are coroutines that are resumed after the updates of each frame,
+// round-robin from a ring buffer until the budget for the frame is used up,
+// so a task that yields often is resumed many times per frame; the clock is
+// only checked between resumes, so a task has to yield to give up its turn;
+// at least one task runs every frame, so all of them progress
+//
+// tasks started while the tasks are running wait for the next frame; the ring
+// buffer always keeps a slot for the task being resumed, so putting it back
+// never has to allocate
+
+typedef struct eso_Task {
+  lua_State *thread;
+  int ref; // registry ref keeping the thread alive
+  int argc; // arguments for the first resume, 0 afterwards
+  bool waiting; // started while the tasks were running
+} eso_Task;
+
+static eso_Task *eso_tasks = NULL;
+static int eso_taskhead = 0;
+static int eso_taskcount = 0;
+static int eso_taskcapacity = 0;
+static int eso_taskreserved = 0; // 1 while a task is being resumed
+static int eso_waitingtasks = 0;
+static double eso_taskbudget = ESO_TASK_BUDGET;
+static bool eso_runningtasks = false;
+
+static void eso_pushtask(lua_State *L, const eso_Task *task) {
+  if (eso_taskcount + eso_taskreserved == eso_taskcapacity) {
+    int capacity = eso_taskcapacity * 2 + 16;
+    eso_Task *tasks = malloc(capacity * sizeof(eso_Task));
+    if (tasks == NULL) {
+      luaL_error(L, "not enough memory");
+    }
+    for (int i = 0; i < eso_taskcount; ++i) {
+      tasks[i] = eso_tasks[(eso_taskhead + i) % eso_taskcapacity];
+    }
+    free(eso_tasks);
+    eso_tasks = tasks;
+    eso_taskhead = 0;
+    eso_taskcapacity = capacity;
+  }
+  eso_tasks[(eso_taskhead + eso_taskcount++) % eso_taskcapacity] = *task;
+}
+
+static eso_Task eso_poptask() {
+  eso_Task task = eso_tasks[eso_taskhead];
+  eso_taskhead = (eso_taskhead + 1) % eso_taskcapacity;
+  eso_taskcount--;
+  return task;
+}
+
+// eso.RunTask(fn, ...) starts fn with the arguments on the next frame and
+// returns its coroutine
+static int esoL_runtask(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  int argc = lua_gettop(L) - 1;
+  eso_Task task;
+  task.thread = lua_newthread(L);
+  lua_pushvalue(L, -1);
+  task.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  task.argc = argc;
+  task.waiting = eso_runningtasks;
+  eso_pushtask(L, &task);
+  eso_waitingtasks += task.waiting;
+  lua_insert(L, 1);
+  lua_xmove(L, task.thread, argc + 1); // the function and its arguments
+  return 1;
+}
+
+// resumes the tasks until the budget runs out and returns how many resumes
+// there were
+static int eso_runtasks(lua_State *L) {
+  if (eso_runningtasks || eso_taskcount == 0) { // called from a task
+    return 0;
+  }
+
+  eso_runningtasks = true;
+  double deadline = eso_getclock() + eso_taskbudget;
+  int resumes = 0;
+  do {
+    eso_Task task = eso_poptask();
+    if (task.waiting) {
+      eso_pushtask(L, &task);
+      continue;
+    }
+    eso_taskreserved = 1;
+    int status = lua_resume(task.thread, task.argc);
+    eso_taskreserved = 0;
+    resumes++;
+    if (status == LUA_YIELD) {
+      lua_settop(task.thread, 0);
+      task.argc = 0;
+      eso_pushtask(L, &task);
+      continue;
+    }
+    if (status != 0) {
+      const char *message = lua_tostring(task.thread, -1);
+      printf("Error in task: %s\n",
+             message != NULL ? message : "(error object is not a string)");
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, task.ref);
+  } while (eso_taskcount > eso_waitingtasks && eso_getclock() < deadline);
+
+  for (int i = 0; i < eso_taskcount; ++i) {
+    eso_tasks[(eso_taskhead + i) % eso_taskcapacity].waiting = false;
+  }
+  eso_waitingtasks = 0;
+  eso_runningtasks = false;
+  return resumes;
+}
+
+// eso.SetTaskBudget(ms) sets how long tasks may run per frame
+static int esoL_settaskbudget(lua_State *L) {
+  eso_taskbudget = luaL_optnumber(L, 1, ESO_TASK_BUDGET);
+  return 0;
+}
+
+static int esoL_getnumpendingtasks(lua_State *L) {
+  lua_pushinteger(L, eso_taskcount);
+  return 1;
+}
+
+static int esoL_cleartasks(lua_State *L) {
+  while (eso_taskcount > 0) {
+    eso_Task task = eso_poptask();
+    luaL_unref(L, LUA_REGISTRYINDEX, task.ref);
+  }
+  eso_waitingtasks = 0;
+  return 0;
+}
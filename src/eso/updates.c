@@ -0,0 +1,292 @@
+#define ESO_UPDATES_INDEX "eso.updates" // namespace -> update id
+
+// registered updates live in a binary min-heap ordered by due time, with
+// ties broken by registration order; registering and unregistering cost
+// O(log n) and the next deadline is always at the root
+
+typedef struct eso_Update {
+  double time;
+  double interval;
+  unsigned int order;
+  unsigned int generation; // bumped when the id is released
+  int callback;            // registry ref
+  int namespace;           // registry ref
+  int stats;               // index into eso_handlerstats
+  int heapIndex;           // -1 while it is running or once released
+} eso_Update;
+
+typedef struct eso_DueUpdate {
+  int id;
+  unsigned int generation;
+} eso_DueUpdate;
+
+static eso_Update *eso_updates = NULL;
+static int eso_updatecount = 0;
+static int eso_updatecapacity = 0;
+static int *eso_freeupdates = NULL;
+static int eso_freeupdatecount = 0;
+static int eso_freeupdatecapacity = 0;
+static int *eso_updateheap = NULL;
+static int eso_updateheapsize = 0;
+static int eso_updateheapcapacity = 0;
+static eso_DueUpdate *eso_dueupdates = NULL;
+static int eso_dueupdatecapacity = 0;
+static unsigned int eso_updateorder = 0;
+static bool eso_runningupdates = false;
+
+static bool eso_isupdatebefore(int a, int b) {
+  const eso_Update *x = &eso_updates[a];
+  const eso_Update *y = &eso_updates[b];
+  return x->time < y->time || (x->time == y->time && x->order < y->order);
+}
+
+static void eso_setupdateheapentry(int index, int id) {
+  eso_updateheap[index] = id;
+  eso_updates[id].heapIndex = index;
+}
+
+static void eso_siftupdateup(int index) {
+  int id = eso_updateheap[index];
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    if (!eso_isupdatebefore(id, eso_updateheap[parent])) {
+      break;
+    }
+    eso_setupdateheapentry(index, eso_updateheap[parent]);
+    index = parent;
+  }
+  eso_setupdateheapentry(index, id);
+}
+
+static void eso_siftupdatedown(int index) {
+  int id = eso_updateheap[index];
+  for (;;) {
+    int child = 2 * index + 1;
+    if (child >= eso_updateheapsize) {
+      break;
+    }
+    if (child + 1 < eso_updateheapsize &&
+        eso_isupdatebefore(eso_updateheap[child + 1], eso_updateheap[child])) {
+      child++;
+    }
+    if (!eso_isupdatebefore(eso_updateheap[child], id)) {
+      break;
+    }
+    eso_setupdateheapentry(index, eso_updateheap[child]);
+    index = child;
+  }
+  eso_setupdateheapentry(index, id);
+}
+
+// the heap always has room for every allocated update, see eso_newupdate
+static void eso_pushupdate(int id) {
+  eso_setupdateheapentry(eso_updateheapsize++, id);
+  eso_siftupdateup(eso_updateheapsize - 1);
+}
+
+static void eso_removeupdate(int id) {
+  int index = eso_updates[id].heapIndex;
+  eso_updates[id].heapIndex = -1;
+  int last = eso_updateheap[--eso_updateheapsize];
+  if (index == eso_updateheapsize) {
+    return;
+  }
+  eso_setupdateheapentry(index, last);
+  if (index > 0 && eso_isupdatebefore(last, eso_updateheap[(index - 1) / 2])) {
+    eso_siftupdateup(index);
+  } else {
+    eso_siftupdatedown(index);
+  }
+}
+
+static int eso_newupdate(lua_State *L) {
+  if (eso_freeupdatecount > 0) {
+    return eso_freeupdates[--eso_freeupdatecount];
+  }
+  if (!eso_growarray((void **)&eso_updates, &eso_updatecapacity,
+                     eso_updatecount, sizeof(eso_Update)) ||
+      !eso_growarray((void **)&eso_updateheap, &eso_updateheapcapacity,
+                     eso_updatecount, sizeof(int)) ||
+      !eso_growarray((void **)&eso_freeupdates, &eso_freeupdatecapacity,
+                     eso_updatecount, sizeof(int)) ||
+      !eso_growarray((void **)&eso_dueupdates, &eso_dueupdatecapacity,
+                     eso_updatecount, sizeof(eso_DueUpdate))) {
+    luaL_error(L, "not enough memory");
+  }
+  eso_updates[eso_updatecount].generation = 0;
+  return eso_updatecount++;
+}
+
+static void eso_releaseupdate(lua_State *L, int id) {
+  eso_Update *update = &eso_updates[id];
+  if (update->heapIndex >= 0) {
+    eso_removeupdate(id);
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, update->callback);
+  luaL_unref(L, LUA_REGISTRYINDEX, update->namespace);
+  update->callback = LUA_NOREF;
+  update->namespace = LUA_NOREF;
+  update->generation++;
+  eso_freeupdates[eso_freeupdatecount++] = id;
+}
+
+static int esoL_registerforupdate(lua_State *L) {
+  const char *name = luaL_checkstring(L, 2);
+  lua_Number interval = luaL_checknumber(L, 3);
+  eso_log("Register for update %s with interval %.14g", name, interval);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, ESO_UPDATES_INDEX);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1)) {
+    eso_log("Already registered");
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  lua_pop(L, 1);
+
+  int stats = eso_gethandlerstats(L, 2);
+  int id = eso_newupdate(L);
+  eso_Update *update = &eso_updates[id];
+  update->stats = stats;
+  update->time = eso_getgametimemilliseconds(false) + interval;
+  update->interval = interval;
+  update->order = eso_updateorder++;
+  lua_pushvalue(L, 4);
+  update->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, 2);
+  update->namespace = luaL_ref(L, LUA_REGISTRYINDEX);
+  eso_pushupdate(id);
+
+  lua_pushvalue(L, 2);
+  lua_pushinteger(L, id);
+  lua_rawset(L, -3);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int esoL_unregisterforupdate(lua_State *L) {
+  const char *name = luaL_checkstring(L, 2);
+  eso_log("Unregister for update %s", name);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, ESO_UPDATES_INDEX);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1)) {
+    eso_log("Not registered");
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  eso_releaseupdate(L, (int)lua_tointeger(L, -1));
+  lua_pop(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// puts the updates that did not get to run back where they were
+static void eso_restoredueupdates(int from, int count) {
+  for (int i = from; i < count; ++i) {
+    const eso_DueUpdate *due = &eso_dueupdates[i];
+    eso_Update *update = &eso_updates[due->id];
+    if (update->generation == due->generation && update->heapIndex < 0) {
+      eso_pushupdate(due->id);
+    }
+  }
+}
+
+// runs every update that is due at the frame time and returns how many ran;
+// updates that are unregistered by an earlier one in the same frame are
+// skipped
+static int eso_runupdates(lua_State *L, double frameTime) {
+  if (eso_runningupdates) { // called from an update
+    return 0;
+  }
+
+  int count = 0;
+  while (eso_updateheapsize > 0 &&
+         eso_updates[eso_updateheap[0]].time <= frameTime) {
+    int id = eso_updateheap[0];
+    eso_removeupdate(id);
+    eso_dueupdates[count].id = id;
+    eso_dueupdates[count].generation = eso_updates[id].generation;
+    count++;
+  }
+  if (count > 0) {
+    eso_log("Run %d pending updates", count);
+  }
+
+  eso_runningupdates = true;
+  int ran = 0;
+  for (int i = 0; i < count; ++i) {
+    // copied, as updates registered by the callback can move the list
+    eso_DueUpdate due = eso_dueupdates[i];
+    if (eso_updates[due.id].generation != due.generation) {
+      continue;
+    }
+
+    int stats = eso_updates[due.id].stats;
+    eso_HandlerCall call;
+    eso_beginhandler(L, &call);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, eso_updates[due.id].callback);
+    if (lua_pcall(L, 0, 0, 0) != 0) {
+      if (!eso_profilingframes) {
+        // like before, the error goes to the caller and the update stays due
+        eso_restoredueupdates(i, count);
+        eso_runningupdates = false;
+        lua_error(L);
+      }
+      // a failing update must not keep the others from being profiled
+      const char *message = lua_tostring(L, -1);
+      printf("Error in update handler: %s\n",
+             message != NULL ? message : "(error object is not a string)");
+      lua_pop(L, 1);
+    }
+    eso_endhandler(L, stats, &call);
+    ran++;
+
+    eso_Update *update = &eso_updates[due.id];
+    if (update->generation == due.generation) {
+      update->time = eso_getgametimemilliseconds(false) + update->interval;
+      update->order = eso_updateorder++;
+      eso_pushupdate(due.id);
+    }
+  }
+  eso_runningupdates = false;
+  return ran;
+}
+
+static int esoL_runpendingupdates(lua_State *L) {
+  lua_pushinteger(L, eso_runupdates(L, luaL_checknumber(L, 1)));
+  return 1;
+}
+
+// returns the time of the next update and the number of registered updates
+static int esoL_getnextupdatetime(lua_State *L) {
+  if (eso_updateheapsize == 0) {
+    lua_pushnil(L);
+  } else {
+    lua_pushnumber(L, eso_updates[eso_updateheap[0]].time);
+  }
+  lua_pushinteger(L, eso_updateheapsize);
+  return 2;
+}
+
+static int esoL_clearupdates(lua_State *L) {
+  for (int id = 0; id < eso_updatecount; ++id) { // includes running ones
+    if (eso_updates[id].callback != LUA_NOREF) {
+      eso_releaseupdate(L, id);
+    }
+  }
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, ESO_UPDATES_INDEX);
+  return 0;
+}
+
+static void eso_openupdates(lua_State *L) {
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, ESO_UPDATES_INDEX);
+}
@@ -24,6 +24,13 @@
 
 #include "lauxlib.h"
 
+#if defined(LUA_USE_MMAP)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 #define FREELIST_REF	0	/* free list of references */
 
@@ -555,6 +562,87 @@ static int errfile (lua_State *L, const char *what, int fnameindex) {
 }
 
 
+#if defined(LUA_USE_MMAP)
+
+typedef struct LoadM {
+  int extraline;
+  const char *s;
+  size_t size;
+} LoadM;
+
+
+static const char *getM (lua_State *L, void *ud, size_t *size) {
+  LoadM *lm = (LoadM *)ud;
+  (void)L;
+  if (lm->extraline) {
+    lm->extraline = 0;
+    *size = 1;
+    return "\n";
+  }
+  if (lm->size == 0) return NULL;
+  *size = lm->size;  /* the whole file as a single block */
+  lm->size = 0;
+  return lm->s;
+}
+
+
+/*
+** Loads a regular file through a read-only mapping, so the lexer sees it
+** as one block without any copying. Returns -1 when the file cannot be
+** mapped (pipes, devices, empty files); the caller then falls back to stdio.
+*/
+static int loadmapped (lua_State *L, const char *filename) {
+  LoadM lm;
+  struct stat st;
+  const char *data, *p, *end;
+  size_t size;
+  int status;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+      (off_t)(size_t)st.st_size != st.st_size) {
+    close(fd);
+    return -1;
+  }
+  size = (size_t)st.st_size;
+  data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == (const char *)MAP_FAILED) return -1;
+#if defined(MADV_SEQUENTIAL)
+  madvise((void *)data, size, MADV_SEQUENTIAL);
+#endif
+  p = data;
+  end = data + size;
+  lm.extraline = 0;
+  if (*p == '\xEF') {  /* skip UTF-8 BOM */
+    if (end - p < 3 || memcmp(p, "\xEF\xBB\xBF", 3) != 0) {
+      /* same error as the stdio path; the caller removes the file name */
+      munmap((void *)data, size);
+      lua_pushfstring(L, "cannot read %s: %s", lua_tostring(L, -1) + 1,
+                      strerror(errno));
+      return LUA_ERRFILE;
+    }
+    p += 3;
+  }
+  if (p < end && *p == '#') {  /* Unix exec. file? */
+    lm.extraline = 1;
+    while (p < end && *p++ != '\n') ;  /* skip first line */
+  }
+  if (p < end && *p == LUA_SIGNATURE[0]) {  /* binary file? */
+    /* skip eventual `#!...' */
+    p = (const char *)memchr(data, LUA_SIGNATURE[0], size);
+    lm.extraline = 0;
+  }
+  lm.s = p;
+  lm.size = end - p;
+  status = lua_load(L, getM, &lm, lua_tostring(L, -1));
+  munmap((void *)data, size);
+  return status;
+}
+
+#endif
+
+
 LUALIB_API int luaL_loadfile (lua_State *L, const char *filename) {
   LoadF lf;
   int status, readstatus;
@@ -567,6 +655,13 @@ LUALIB_API int luaL_loadfile (lua_State *L, const char *filename) {
   }
   else {
     lua_pushfstring(L, "@%s", filename);
+#if defined(LUA_USE_MMAP)
+    status = loadmapped(L, filename);
+    if (status != -1) {
+      lua_remove(L, fnameindex);
+      return status;
+    }
+#endif
     lf.f = fopen(filename, "r");
     if (lf.f == NULL) return errfile(L, "open", fnameindex);
   }
@@ -278,7 +278,9 @@ static int nilK (FuncState *fs) {
 
 
 void luaK_setreturns (FuncState *fs, expdesc *e, int nresults) {
-  if (e->k == VCALL) {  /* expression is an open function call? */
+  if (e->k == VCALL && e->u.s.aux && nresults == 1)
+    luaK_setoneret(fs, e);  /* bit op call assigned to a local */
+  else if (e->k == VCALL) {  /* expression is an open function call? */
     SETARG_C(getcode(fs, e), nresults+1);
   }
   else if (e->k == VVARARG) {
@@ -289,8 +291,45 @@ void luaK_setreturns (FuncState *fs, expdesc *e, int nresults) {
 }
 
 
+static void bitop (FuncState *fs, expdesc *e) {
+  /* turn a call of a bit function into its op when it has the right number
+     of arguments, folding the loads of constant and local arguments */
+  OpCode op = cast(OpCode, e->u.s.aux);
+  int pc = e->u.s.info;
+  int base = GETARG_A(fs->f->code[pc]);
+  int nargs = (op == OP_BNOT) ? 1 : 2;
+  int rk[2];
+  int arg;
+  e->u.s.aux = 0;
+  if (GETARG_B(fs->f->code[pc]) != nargs+1)
+    return;  /* keep the call, it reports wrong arguments */
+  rk[0] = base+1;
+  rk[1] = base+2;
+  for (arg = nargs; arg >= 1 && pc == fs->pc-1; arg--) {
+    Instruction load;
+    if (pc-1 <= fs->lasttarget)
+      break;  /* a jump may go to the load or the call */
+    load = fs->f->code[pc-1];
+    if (GETARG_A(load) != base+arg)
+      break;
+    if (GET_OPCODE(load) == OP_MOVE)
+      rk[arg-1] = GETARG_B(load);
+    else if (GET_OPCODE(load) == OP_LOADK && GETARG_Bx(load) <= MAXINDEXRK)
+      rk[arg-1] = RKASK(GETARG_Bx(load));
+    else
+      break;
+    fs->f->lineinfo[pc-1] = fs->f->lineinfo[pc];
+    fs->pc--;
+    e->u.s.info = --pc;  /* the op takes the place of the load */
+  }
+  fs->f->code[pc] = CREATE_ABC(op, base, rk[0], (nargs == 2) ? rk[1] : 0);
+}
+
+
 void luaK_setoneret (FuncState *fs, expdesc *e) {
   if (e->k == VCALL) {  /* expression is an open function call? */
+    if (e->u.s.aux)  /* call of a bit function? */
+      bitop(fs, e);
     e->k = VNONRELOC;
     e->u.s.info = GETARG_A(getcode(fs, e));
   }
@@ -829,3 +868,33 @@ void luaK_setlist (FuncState *fs, int base, int nelems, int tostore) {
   fs->freereg = base + 1;  /* free registers with list values */
 }
 
+
+/*
+** Peephole pass over the complete code of a function: the first instruction
+** of each pair in `luaP_fused' becomes the fused one. The second stays where
+** it is, so jumps to it and the line info are not affected, but it is never
+** fused with the instruction after it.
+*/
+void luaK_fuse (FuncState *fs) {
+  Proto *f = fs->f;
+  Instruction *code = f->code;
+  int pc;
+  for (pc = 0; pc < fs->pc - 1; pc++) {
+    OpCode o = GET_OPCODE(code[pc]);
+    OpCode next = GET_OPCODE(code[pc+1]);
+    int n;
+    if (o == OP_SETLIST && GETARG_C(code[pc]) == 0)
+      pc++;  /* skip the count in the next `instruction' */
+    else if (o == OP_CLOSURE)
+      pc += f->p[GETARG_Bx(code[pc])]->nups;  /* skip pseudo-instructions */
+    else {
+      for (n = 0; n < NUM_FUSED; n++) {
+        if (luaP_fused[n][0] == o && luaP_fused[n][1] == next) {
+          SET_OPCODE(code[pc], cast(OpCode, cast_int(OP_GGETTABLE) + n));
+          pc++;  /* skip the second instruction */
+          break;
+        }
+      }
+    }
+  }
+}
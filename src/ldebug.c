@@ -370,7 +370,11 @@ static Instruction symbexec (const Proto *pt, int lastpc, int reg) {
       check(pc+2 < pt->sizecode);  /* check skip */
       check(GET_OPCODE(pt->code[pc+1]) == OP_JMP);
     }
-    switch (op) {
+    if (isfused(op)) {
+      check(pc+1 < pt->sizecode);  /* check the second instruction */
+      check(GET_OPCODE(pt->code[pc+1]) == fusednext(op));
+    }
+    switch (unfused(op)) {
       case OP_LOADBOOL: {
         if (c == 1) {  /* does it jump? */
           check(pc+2 < pt->sizecode);  /* check its jump */
@@ -505,7 +509,7 @@ static const char *getobjname (lua_State *L, CallInfo *ci, int stackpos,
       return "local";
     i = symbexec(p, pc, stackpos);  /* try symbolic execution */
     lua_assert(pc != -1);
-    switch (GET_OPCODE(i)) {
+    switch (unfused(GET_OPCODE(i))) {
       case OP_GETGLOBAL: {
         int g = GETARG_Bx(i);  /* global index */
         lua_assert(ttisstring(&p->k[g]));
@@ -548,7 +552,7 @@ static const char *getfuncname (lua_State *L, CallInfo *ci, const char **name) {
   ci--;  /* calling function */
   i = ci_func(ci)->l.p->code[currentpc(L, ci)];
   if (GET_OPCODE(i) == OP_CALL || GET_OPCODE(i) == OP_TAILCALL ||
-      GET_OPCODE(i) == OP_TFORLOOP)
+      GET_OPCODE(i) == OP_TFORLOOP || isbitop(GET_OPCODE(i)))
     return getobjname(L, ci, GETARG_A(i), name);
   else
     return NULL;  /* no useful name can be found */
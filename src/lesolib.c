@@ -1,11 +1,20 @@
+#include <ctype.h>
+#include <dirent.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(_WIN32)
+#include <direct.h>
+#include <windows.h>
+#endif
+
 #define lesolib_c
 #define LUA_LIB
 
@@ -13,19 +22,64 @@
 
 #include "lapi.h"
 #include "lauxlib.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lopcodes.h"
+#include "lstate.h"
 #include "lualib.h"
+#include "lundump.h"
+
+// in virtual time the clock only moves when something sleeps, which then
+// returns immediately; this makes runs deterministic and independent of how
+// long the updates are waiting for
+static bool eso_virtualclock = false;
+static double eso_virtualtime = 0;
+static long eso_realclockoffset = 0; // virtual time that passed in runs
+
+LUA_API void eso_set_virtual_clock(int enable) {
+  eso_virtualclock = enable;
+  eso_virtualtime = 0;
+}
 
 static long eso_getgametimemilliseconds(bool init) {
   static struct timeval startTime;
-  if (init) {
+  if (eso_virtualclock) {
+    return (long)eso_virtualtime;
+  } else if (init) {
     gettimeofday(&startTime, NULL);
+    eso_realclockoffset = 0;
     return 0;
   } else {
     struct timeval now;
     gettimeofday(&now, NULL);
     long deltaS = (now.tv_sec - startTime.tv_sec) * 1000;
     long deltaMS = (now.tv_usec - startTime.tv_usec) / 1000;
-    return deltaS + deltaMS;
+    return deltaS + deltaMS + eso_realclockoffset;
+  }
+}
+
+// switches to the virtual clock for a run, continuing from the current game
+// time; returns the previous mode for eso_endvirtualclock
+static bool eso_beginvirtualclock() {
+  bool wasVirtual = eso_virtualclock;
+  if (!wasVirtual) {
+    double now = eso_getgametimemilliseconds(false);
+    eso_virtualclock = true;
+    eso_virtualtime = now;
+  }
+  return wasVirtual;
+}
+
+// switches back to the real clock if that was used before the run; it then
+// continues from the virtual time, so the game time never goes backwards
+static void eso_endvirtualclock(bool wasVirtual) {
+  if (!wasVirtual) {
+    eso_virtualclock = false;
+    long now = eso_getgametimemilliseconds(false);
+    if ((long)eso_virtualtime > now) {
+      eso_realclockoffset += (long)eso_virtualtime - now;
+    }
   }
 }
 
@@ -97,22 +151,64 @@ static bool eso_isluafile(const char *fileName) {
          strcmp(fileName + strlen(fileName) - 4, ".lua") == 0;
 }
 
-static bool eso_tryloadluafile(lua_State *L, const char *fileName) {
-  eso_log("try load Lua file '%s'", fileName);
+#include "eso/stats.c"
+#include "eso/cache.c"
+#include "eso/image.c"
+
+// runs the loaded chunk and adds the record with its execution stats; on
+// failure the error message is left on the stack
+static int eso_runluachunk(lua_State *L, eso_LoadRecord *record) {
+  double start = eso_getclock();
+  size_t allocated = eso_getallocatedbytes(L);
+  int status = lua_pcall(L, 0, 0, 0);
+  record->execTime = eso_getclock() - start;
+  record->execBytes = eso_getallocatedbytes(L) - allocated;
+  eso_addloadrecord(record);
+  return status;
+}
 
-  if (luaL_loadfile(L, fileName) != 0) {
-    eso_log(lua_tostring(L, -1));
+static bool eso_tryrunluachunk(lua_State *L, eso_LoadRecord *record) {
+  if (eso_runluachunk(L, record) != 0) {
+    eso_log("%s", lua_tostring(L, -1));
+    lua_pop(L, 1);
     return false;
   }
+  return true;
+}
+
+// loads and runs a Lua file; on failure the error message is left on the
+// stack
+static int eso_runluafile(lua_State *L, const char *fileName) {
+  eso_log("try load Lua file '%s'", fileName);
+
+  eso_LoadRecord record = {strdup(fileName)};
+  int status = eso_loadluafile(L, fileName, &record);
+  if (status != 0) {
+    eso_addloadrecord(&record);
+    return status;
+  }
+  return eso_runluachunk(L, &record);
+}
 
-  if (lua_pcall(L, 0, 0, 0) != 0) {
-    eso_log(lua_tostring(L, -1));
+static bool eso_tryloadluafile(lua_State *L, const char *fileName) {
+  if (eso_runluafile(L, fileName) != 0) {
+    eso_log("%s", lua_tostring(L, -1));
+    lua_pop(L, 1);
     return false;
   }
-
   return true;
 }
 
+#include "eso/compile.c"
+#include "eso/lazy.c"
+#include "eso/manifest.c"
+#include "eso/profile.c"
+#include "eso/updates.c"
+#include "eso/tasks.c"
+#include "eso/events.c"
+#include "eso/frames.c"
+#include "eso/replay.c"
+
 // actual lib functions
 
 static int esoL_loadaddon(lua_State *L) {
@@ -124,43 +220,86 @@ static int esoL_loadaddon(lua_State *L) {
     return 1;
   }
 
-  FILE *fp = fopen(path, "r");
   eso_log("try open manifest file '%s'", path);
+  eso_Buffer buffer = {NULL, 0, 0};
+  const eso_Manifest *manifest = eso_getmanifest(path, &buffer);
+  free(buffer.data);
 
-  if (fp == NULL) {
+  if (manifest == NULL) {
     lua_pushboolean(L, 0);
     eso_log("failed to open manifest file '%s'", path);
+    free(path);
     return 1;
   }
+  free(path);
 
-  char *basepath = eso_getbasepath(path);
+  eso_loadmanifest(L, manifest);
 
-  char line[1024];
-  char fileToLoad[1024 + PATH_MAX];
-  while (fgets(line, sizeof(line), fp)) {
-    if (line[0] == '#' || line[0] == ';' || line[0] == '\r' ||
-        line[0] == '\n') {
-      continue;
-    }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int esoL_loadaddons(lua_State *L) {
+  eso_ManifestList manifests = {NULL, 0, 0};
+  eso_Buffer buffer = {NULL, 0, 0};
 
-    if (line[strlen(line) - 1] == '\n') {
-      line[strlen(line) - 1] = '\0';
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    char *folder = eso_resolvefilepath(lua_tostring(L, 1));
+    if (folder == NULL) {
+      lua_pushboolean(L, 0);
+      return 1;
     }
 
-    if (eso_isluafile(line)) {
-      sprintf(fileToLoad, "%s%s", basepath, line);
-      eso_tryloadluafile(L, fileToLoad);
+    // all paths are built in place from the resolved folder
+    char path[PATH_MAX];
+    size_t length = strlen(folder);
+    while (length > 1 && (folder[length - 1] == '/' ||
+                          (folder[length - 1] == '.' &&
+                           folder[length - 2] == '/'))) {
+      length -= folder[length - 1] == '.' ? 2 : 1;
+    }
+    if (length < sizeof(path)) {
+      memcpy(path, folder, length);
+      path[length] = '\0';
+      eso_log("search addons in '%s'", path);
+      eso_findmanifests(&manifests, path, length, 1, &buffer);
+    }
+    free(folder);
+  } else {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int count = (int)lua_objlen(L, 1);
+    for (int i = 1; i <= count; ++i) {
+      lua_rawgeti(L, 1, i);
+      const char *filePath = lua_tostring(L, -1);
+      char *path = filePath != NULL ? eso_resolvefilepath(filePath) : NULL;
+      lua_pop(L, 1);
+      if (path == NULL) {
+        continue;
+      }
+
+      const eso_Manifest *manifest = eso_getmanifest(path, &buffer);
+      if (manifest != NULL) {
+        eso_addmanifest(&manifests, manifest);
+      } else {
+        eso_log("failed to open manifest file '%s'", path);
+      }
+      free(path);
     }
   }
+  free(buffer.data);
 
-  fclose(fp);
-  free(basepath);
-  free(path);
-
-  lua_pushboolean(L, 1);
+  eso_loadaddons(L, manifests.items, manifests.count);
+  free(manifests.items);
   return 1;
 }
 
+static int esoL_setmanifestvariable(lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  const char *value = luaL_checkstring(L, 2);
+  eso_setmanifestvariable(name, value);
+  return 0;
+}
+
 static int esoL_loadluafile(lua_State *L) {
   const char *filePath = luaL_checkstring(L, 1);
 
@@ -181,6 +320,32 @@ static int esoL_loadluafile(lua_State *L) {
   return 1;
 }
 
+static int esoL_getloadstats(lua_State *L) {
+  lua_createtable(L, eso_loadrecordcount, 0);
+  for (int i = 0; i < eso_loadrecordcount; ++i) {
+    const eso_LoadRecord *record = &eso_loadrecords[i];
+    lua_createtable(L, 0, 8);
+    lua_pushstring(L, record->path);
+    lua_setfield(L, -2, "file");
+    lua_pushnumber(L, record->size);
+    lua_setfield(L, -2, "size");
+    lua_pushboolean(L, record->cached);
+    lua_setfield(L, -2, "cached");
+    lua_pushnumber(L, record->readTime);
+    lua_setfield(L, -2, "readTime");
+    lua_pushnumber(L, record->parseTime);
+    lua_setfield(L, -2, "parseTime");
+    lua_pushnumber(L, record->execTime);
+    lua_setfield(L, -2, "execTime");
+    lua_pushnumber(L, record->parseBytes);
+    lua_setfield(L, -2, "parseBytes");
+    lua_pushnumber(L, record->execBytes);
+    lua_setfield(L, -2, "execBytes");
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
 static int esoL_getgametimemilliseconds(lua_State *L) {
   lua_pushnumber(L, eso_getgametimemilliseconds(false));
   return 1;
@@ -188,10 +353,26 @@ static int esoL_getgametimemilliseconds(lua_State *L) {
 
 static int esoL_sleep(lua_State *L) {
   lua_Number ms = luaL_checknumber(L, 1);
-  usleep(ms * 1000);
+  if (eso_virtualclock) {
+    if (ms > 0) {
+      eso_virtualtime += ms;
+    }
+  } else {
+    usleep(ms * 1000);
+  }
   return 0;
 }
 
+// replaces os.clock, so it follows the virtual clock when that is enabled
+static int esoL_clock(lua_State *L) {
+  if (eso_virtualclock) {
+    lua_pushnumber(L, eso_virtualtime / 1000);
+  } else {
+    lua_pushnumber(L, ((lua_Number)clock()) / (lua_Number)CLOCKS_PER_SEC);
+  }
+  return 1;
+}
+
 #include "eso/id64.c"
 
 static const luaL_Reg eso_funcs[] = {
@@ -206,20 +387,77 @@ static const luaL_Reg eso_funcs[] = {
     {"BitLShift", esoL_bitLShift},
     {"BitRShift", esoL_bitRShift},
     {"GetGameTimeMilliseconds", esoL_getgametimemilliseconds},
+    {"GetFrameTimeMilliseconds", esoL_getframetimemilliseconds},
+    {"GetFrameTimeSeconds", esoL_getframetimeseconds},
     {NULL, NULL}};
 
 static const luaL_Reg esolib[] = {{"LoadAddon", esoL_loadaddon},
+                                  {"LoadAddons", esoL_loadaddons},
+                                  {"StringToId64Batch",
+                                   esoL_stringtoid64batch},
+                                  {"Id64ToStringBatch",
+                                   esoL_id64tostringbatch},
+                                  {"Id64Map", esoL_newid64map},
+                                  {"SetManifestVariable",
+                                   esoL_setmanifestvariable},
                                   {"LoadLuaFile", esoL_loadluafile},
+                                  {"GetLoadStats", esoL_getloadstats},
+                                  {"LoadLuaFilesLazily",
+                                   esoL_loadluafileslazily},
                                   {"Sleep", esoL_sleep},
+                                  {"TriggerEvent", esoL_triggerevent},
+                                  {"SetEventFilterArgument",
+                                   esoL_seteventfilterargument},
+                                  {"HandlePendingEvents",
+                                   esoL_handlependingevents},
+                                  {"GetNumPendingEvents",
+                                   esoL_getnumpendingevents},
+                                  {"ClearPendingEvents",
+                                   esoL_clearpendingevents},
+                                  {"RunPendingUpdates",
+                                   esoL_runpendingupdates},
+                                  {"GetNextUpdateTime",
+                                   esoL_getnextupdatetime},
+                                  {"ClearUpdates", esoL_clearupdates},
+                                  {"RunTask", esoL_runtask},
+                                  {"SetTaskBudget", esoL_settaskbudget},
+                                  {"GetNumPendingTasks",
+                                   esoL_getnumpendingtasks},
+                                  {"ClearTasks", esoL_cleartasks},
+                                  {"RunFrame", esoL_runframe},
+                                  {"RunFrames", esoL_runframes},
+                                  {"ReplayEvents", esoL_replayevents},
+                                  {"GetHandlerStats", esoL_gethandlerstats},
+                                  {"EnableHandlerStats",
+                                   esoL_enablehandlerstats},
                                   {NULL, NULL}};
 
 LUALIB_API int luaopen_eso(lua_State *L) {
   eso_getgametimemilliseconds(true);
+  eso_countallocations(L, &eso_mainalloccounter);
 
   lua_pushvalue(L, LUA_GLOBALSINDEX);
   luaL_register(L, NULL, eso_funcs);
   lua_pop(L, 1);
 
+  lua_getglobal(L, LUA_OSLIBNAME);
+  if (lua_istable(L, -1)) {
+    lua_pushcfunction(L, esoL_clock);
+    lua_setfield(L, -2, "clock");
+  }
+  lua_pop(L, 1);
+
   luaL_register(L, LUA_ESOLIBNAME, esolib);
+  eso_openevents(L);
+  eso_openid64map(L);
+
+  // lets the bit op instructions know when the globals are untouched
+  global_State *g = G(L);
+  g->bitopf[OP_BAND - OP_BAND] = esoL_bitAnd;
+  g->bitopf[OP_BOR - OP_BAND] = esoL_bitOr;
+  g->bitopf[OP_BXOR - OP_BAND] = esoL_bitXor;
+  g->bitopf[OP_SHL - OP_BAND] = esoL_bitLShift;
+  g->bitopf[OP_SHR - OP_BAND] = esoL_bitRShift;
+  g->bitopf[OP_BNOT - OP_BAND] = esoL_bitNot;
   return 2;
 }
@@ -16,6 +16,7 @@
 #include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 
 
@@ -134,10 +135,52 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+  f->gcache = NULL;
+  f->mcache = NULL;
+  f->sizegcache = 0;
+  f->sizemcache = 0;
   return f;
 }
 
 
+void luaF_initcaches (lua_State *L, Proto *f) {
+  /* only functions that access globals or constant keys get caches */
+  int pc, i;
+  int globals = 0, methods = 0;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction ins = f->code[pc];
+    switch (unfused(GET_OPCODE(ins))) {
+      case OP_GETGLOBAL: case OP_SETGLOBAL:
+        globals = 1;
+        break;
+      case OP_GETTABLE: case OP_SELF:
+        if (ISK(GETARG_C(ins)) && ttisstring(&f->k[INDEXK(GETARG_C(ins))]))
+          methods = 1;
+        break;
+      default: break;
+    }
+  }
+  if (globals) {
+    f->gcache = luaM_newvector(L, f->sizek, GCache);
+    f->sizegcache = f->sizek;
+    for (i = 0; i < f->sizek; i++) {
+      f->gcache[i].h = NULL;
+      f->gcache[i].n = NULL;
+      f->gcache[i].version = 0;
+    }
+  }
+  if (methods) {
+    f->mcache = luaM_newvector(L, f->sizek, MCache);
+    f->sizemcache = f->sizek;
+    for (i = 0; i < f->sizek; i++) {
+      f->mcache[i].mt = NULL;
+      f->mcache[i].n = NULL;
+      f->mcache[i].epoch = 0;
+    }
+  }
+}
+
+
 void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->code, f->sizecode, Instruction);
   luaM_freearray(L, f->p, f->sizep, Proto *);
@@ -145,6 +188,8 @@ void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
   luaM_freearray(L, f->locvars, f->sizelocvars, struct LocVar);
   luaM_freearray(L, f->upvalues, f->sizeupvalues, TString *);
+  luaM_freearray(L, f->gcache, f->sizegcache, GCache);
+  luaM_freearray(L, f->mcache, f->sizemcache, MCache);
   luaM_free(L, f);
 }
 
@@ -313,7 +313,9 @@ static l_mem propagatemark (global_State *g) {
                              sizeof(TValue) * p->sizek + 
                              sizeof(int) * p->sizelineinfo +
                              sizeof(LocVar) * p->sizelocvars +
-                             sizeof(TString *) * p->sizeupvalues;
+                             sizeof(TString *) * p->sizeupvalues +
+                             sizeof(GCache) * p->sizegcache +
+                             sizeof(MCache) * p->sizemcache;
     }
     default: lua_assert(0); return 0;
   }
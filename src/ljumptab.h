@@ -0,0 +1,62 @@
+/*
+** Dispatch tables of luaV_execute for LUA_USE_JUMPTABLE
+** See Copyright Notice in lua.h
+*/
+
+/* included inside luaV_execute, as label addresses are local to it */
+
+static const void *const optab[NUM_OPCODES] = {
+  [OP_MOVE] = &&L_OP_MOVE,
+  [OP_LOADK] = &&L_OP_LOADK,
+  [OP_LOADBOOL] = &&L_OP_LOADBOOL,
+  [OP_LOADNIL] = &&L_OP_LOADNIL,
+  [OP_GETUPVAL] = &&L_OP_GETUPVAL,
+  [OP_GETGLOBAL] = &&L_OP_GETGLOBAL,
+  [OP_GETTABLE] = &&L_OP_GETTABLE,
+  [OP_SETGLOBAL] = &&L_OP_SETGLOBAL,
+  [OP_SETUPVAL] = &&L_OP_SETUPVAL,
+  [OP_SETTABLE] = &&L_OP_SETTABLE,
+  [OP_NEWTABLE] = &&L_OP_NEWTABLE,
+  [OP_SELF] = &&L_OP_SELF,
+  [OP_ADD] = &&L_OP_ADD,
+  [OP_SUB] = &&L_OP_SUB,
+  [OP_MUL] = &&L_OP_MUL,
+  [OP_DIV] = &&L_OP_DIV,
+  [OP_MOD] = &&L_OP_MOD,
+  [OP_POW] = &&L_OP_POW,
+  [OP_UNM] = &&L_OP_UNM,
+  [OP_NOT] = &&L_OP_NOT,
+  [OP_LEN] = &&L_OP_LEN,
+  [OP_CONCAT] = &&L_OP_CONCAT,
+  [OP_JMP] = &&L_OP_JMP,
+  [OP_EQ] = &&L_OP_EQ,
+  [OP_LT] = &&L_OP_LT,
+  [OP_LE] = &&L_OP_LE,
+  [OP_TEST] = &&L_OP_TEST,
+  [OP_TESTSET] = &&L_OP_TESTSET,
+  [OP_CALL] = &&L_OP_CALL,
+  [OP_TAILCALL] = &&L_OP_TAILCALL,
+  [OP_RETURN] = &&L_OP_RETURN,
+  [OP_FORLOOP] = &&L_OP_FORLOOP,
+  [OP_FORPREP] = &&L_OP_FORPREP,
+  [OP_TFORLOOP] = &&L_OP_TFORLOOP,
+  [OP_SETLIST] = &&L_OP_SETLIST,
+  [OP_CLOSE] = &&L_OP_CLOSE,
+  [OP_CLOSURE] = &&L_OP_CLOSURE,
+  [OP_VARARG] = &&L_OP_VARARG,
+  [OP_BAND] = &&L_OP_BAND,
+  [OP_BOR] = &&L_OP_BOR,
+  [OP_BXOR] = &&L_OP_BXOR,
+  [OP_SHL] = &&L_OP_SHL,
+  [OP_SHR] = &&L_OP_SHR,
+  [OP_BNOT] = &&L_OP_BNOT,
+  [OP_GGETTABLE] = &&L_OP_GGETTABLE,
+  [OP_GGETCALL] = &&L_OP_GGETCALL,
+  [OP_SELFCALL] = &&L_OP_SELFCALL,
+  [OP_GETTEST] = &&L_OP_GETTEST
+};
+
+/* while line or count hooks are set every instruction goes to the hook */
+static const void *const hooktab[NUM_OPCODES] = {
+  [0 ... NUM_OPCODES-1] = &&vmhook
+};
@@ -225,6 +225,27 @@ typedef union Udata {
 
 
 
+/*
+** Inline cache of the slot a global was found in, one per constant
+*/
+typedef struct GCache {
+  struct Table *h;  /* table the global was found in */
+  struct Node *n;  /* its slot in `h' */
+  unsigned int version;  /* layout version of `h' when it was found */
+} GCache;
+
+
+/*
+** Cache of the slot a constant key was found in through the `__index'
+** tables of a metatable, one per constant
+*/
+typedef struct MCache {
+  struct Table *mt;  /* metatable the lookup started at */
+  struct Node *n;  /* slot of the key in the table that has it */
+  unsigned int epoch;  /* `mcacheepoch' when it was found */
+} MCache;
+
+
 /*
 ** Function Prototypes
 */
@@ -237,12 +258,16 @@ typedef struct Proto {
   struct LocVar *locvars;  /* information about local variables */
   TString **upvalues;  /* upvalue names */
   TString  *source;
+  GCache *gcache;  /* global caches indexed like `k' */
+  MCache *mcache;  /* method caches indexed like `k' */
   int sizeupvalues;
   int sizek;  /* size of `k' */
   int sizecode;
   int sizelineinfo;
   int sizep;  /* size of `p' */
   int sizelocvars;
+  int sizegcache;
+  int sizemcache;
   int linedefined;
   int lastlinedefined;
   GCObject *gclist;
@@ -339,6 +364,7 @@ typedef struct Table {
   CommonHeader;
   lu_byte flags;  /* 1<<p means tagmethod(p) is not present */ 
   lu_byte lsizenode;  /* log2 of size of `node' array */
+  unsigned int version;  /* changes whenever a node gets a different key */
   struct Table *metatable;
   TValue *array;  /* array part */
   Node *node;
@@ -52,10 +52,39 @@ const char *const luaP_opnames[NUM_OPCODES+1] = {
   "CLOSE",
   "CLOSURE",
   "VARARG",
+  "BAND",
+  "BOR",
+  "BXOR",
+  "SHL",
+  "SHR",
+  "BNOT",
+  "GGETTABLE",
+  "GGETCALL",
+  "SELFCALL",
+  "GETTEST",
   NULL
 };
 
 
+const char *const luaP_bitopnames[NUM_BITOPS] = {
+  "BitAnd",
+  "BitOr",
+  "BitXor",
+  "BitLShift",
+  "BitRShift",
+  "BitNot"
+};
+
+
+/* picked by how often the pairs run one after the other in ESOUI code */
+const lu_byte luaP_fused[NUM_FUSED][2] = {
+  {OP_GETGLOBAL, OP_GETTABLE}		/* OP_GGETTABLE */
+ ,{OP_GETGLOBAL, OP_CALL}		/* OP_GGETCALL */
+ ,{OP_SELF, OP_CALL}			/* OP_SELFCALL */
+ ,{OP_GETTABLE, OP_TEST}		/* OP_GETTEST */
+};
+
+
 #define opmode(t,a,b,c,m) (((t)<<7) | ((a)<<6) | ((b)<<4) | ((c)<<2) | (m))
 
 const lu_byte luaP_opmodes[NUM_OPCODES] = {
@@ -98,5 +127,15 @@ const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 0, OpArgN, OpArgN, iABC)		/* OP_CLOSE */
  ,opmode(0, 1, OpArgU, OpArgN, iABx)		/* OP_CLOSURE */
  ,opmode(0, 1, OpArgU, OpArgN, iABC)		/* OP_VARARG */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_BAND */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_BOR */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_BXOR */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_SHL */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_SHR */
+ ,opmode(0, 1, OpArgK, OpArgN, iABC)		/* OP_BNOT */
+ ,opmode(0, 1, OpArgK, OpArgN, iABx)		/* OP_GGETTABLE */
+ ,opmode(0, 1, OpArgK, OpArgN, iABx)		/* OP_GGETCALL */
+ ,opmode(0, 1, OpArgR, OpArgK, iABC)		/* OP_SELFCALL */
+ ,opmode(0, 1, OpArgR, OpArgK, iABC)		/* OP_GETTEST */
 };
 
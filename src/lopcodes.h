@@ -204,11 +204,33 @@ OP_SETLIST,/*	A B C	R(A)[(C-1)*FPF+i] := R(A+i), 1 <= i <= B	*/
 OP_CLOSE,/*	A 	close all variables in the stack up to (>=) R(A)*/
 OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx], R(A), ... ,R(A+n))	*/
 
-OP_VARARG/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
+OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
+
+OP_BAND,/*	A B C	R(A) := R(A)(RK(B), RK(C))			*/
+OP_BOR,/*	A B C	R(A) := R(A)(RK(B), RK(C))			*/
+OP_BXOR,/*	A B C	R(A) := R(A)(RK(B), RK(C))			*/
+OP_SHL,/*	A B C	R(A) := R(A)(RK(B), RK(C))			*/
+OP_SHR,/*	A B C	R(A) := R(A)(RK(B), RK(C))			*/
+OP_BNOT,/*	A B	R(A) := R(A)(RK(B))				*/
+
+OP_GGETTABLE,/*	A Bx	OP_GETGLOBAL; then the OP_GETTABLE that follows	*/
+OP_GGETCALL,/*	A Bx	OP_GETGLOBAL; then the OP_CALL that follows	*/
+OP_SELFCALL,/*	A B C	OP_SELF; then the OP_CALL that follows		*/
+OP_GETTEST/*	A B C	OP_GETTABLE; then the OP_TEST that follows	*/
 } OpCode;
 
 
-#define NUM_OPCODES	(cast(int, OP_VARARG) + 1)
+#define NUM_OPCODES	(cast(int, OP_GETTEST) + 1)
+
+#define NUM_BITOPS	(cast(int, OP_BNOT) - cast(int, OP_BAND) + 1)
+#define isbitop(o)	((o) >= OP_BAND && (o) <= OP_BNOT)
+
+#define NUM_FUSED	(cast(int, OP_GETTEST) - cast(int, OP_GGETTABLE) + 1)
+#define isfused(o)	((o) >= OP_GGETTABLE)
+#define fusedpair(o)	(luaP_fused[cast(int, o) - cast(int, OP_GGETTABLE)])
+/* the instruction a fused one starts with, and the one it must be followed by */
+#define unfused(o)	(isfused(o) ? cast(OpCode, fusedpair(o)[0]) : (o))
+#define fusednext(o)	cast(OpCode, fusedpair(o)[1])
 
 
 
@@ -229,6 +251,17 @@ OP_VARARG/*	A B	R(A), R(A+1), ..., R(A+B-1) = vararg		*/
   (*) For comparisons, A specifies what condition the test should accept
       (true or false).
 
+  (*) The bit operations replace calls to the ESO globals in luaP_bitopnames.
+      R(A) holds the global; when it is the built-in function and the
+      arguments are numbers, the result is computed directly, otherwise the
+      function is called.
+
+  (*) A fused instruction has the operands of the first instruction of its
+      pair in luaP_fused and executes it; the second one follows it in the
+      code and is executed right after it without a separate dispatch. The
+      pairs are formed by luaK_fuse once a function is complete, so jumps
+      may still go to the second instruction alone.
+
   (*) All `skips' (pc++) assume that next instruction is a jump
 ===========================================================================*/
 
@@ -260,6 +293,10 @@ LUAI_DATA const lu_byte luaP_opmodes[NUM_OPCODES];
 
 LUAI_DATA const char *const luaP_opnames[NUM_OPCODES+1];  /* opcode names */
 
+LUAI_DATA const char *const luaP_bitopnames[NUM_BITOPS];  /* global names */
+
+LUAI_DATA const lu_byte luaP_fused[NUM_FUSED][2];  /* fused pairs */
+
 
 /* number of list items to accumulate before a SETLIST instruction */
 #define LFIELDS_PER_FLUSH	50
@@ -359,6 +359,7 @@ static void close_func (LexState *ls) {
   Proto *f = fs->f;
   removevars(ls, 0);
   luaK_ret(fs, 0, 0);  /* final return */
+  luaK_fuse(fs);
   luaM_reallocvector(L, f->code, f->sizecode, fs->pc, Instruction);
   f->sizecode = fs->pc;
   luaM_reallocvector(L, f->lineinfo, f->sizelineinfo, fs->pc, int);
@@ -371,6 +372,7 @@ static void close_func (LexState *ls) {
   f->sizelocvars = fs->nlocvars;
   luaM_reallocvector(L, f->upvalues, f->sizeupvalues, f->nups, TString *);
   f->sizeupvalues = f->nups;
+  luaF_initcaches(L, f);
   lua_assert(luaG_checkcode(f));
   lua_assert(fs->bl == NULL);
   ls->fs = fs->prev;
@@ -649,6 +651,7 @@ static void funcargs (LexState *ls, expdesc *f) {
     nparams = fs->freereg - (base+1);
   }
   init_exp(f, VCALL, luaK_codeABC(fs, OP_CALL, base, nparams+1, 2));
+  f->u.s.aux = 0;  /* not a bit op call (see `bitopcall') */
   luaK_fixline(fs, line);
   fs->freereg = base+1;  /* call remove function and arguments and leaves
                             (unless changed) one result */
@@ -687,6 +690,21 @@ static void prefixexp (LexState *ls, expdesc *v) {
 }
 
 
+static int bitopcall (LexState *ls, expdesc *v) {
+  /* calls of the ESO bit functions through their globals may become bit ops;
+     the global is still read, so the op can fall back to a call when it has
+     been replaced */
+  if (v->k == VGLOBAL && ls->t.token == '(') {
+    const char *name = getstr(rawtsvalue(&ls->fs->f->k[v->u.s.info]));
+    int i;
+    for (i = 0; i < NUM_BITOPS; i++)
+      if (strcmp(name, luaP_bitopnames[i]) == 0)
+        return OP_BAND + i;
+  }
+  return 0;
+}
+
+
 static void primaryexp (LexState *ls, expdesc *v) {
   /* primaryexp ->
         prefixexp { `.' NAME | `[' exp `]' | `:' NAME funcargs | funcargs } */
@@ -714,8 +732,10 @@ static void primaryexp (LexState *ls, expdesc *v) {
         break;
       }
       case '(': case TK_STRING: case '{': {  /* funcargs */
+        int op = bitopcall(ls, v);
         luaK_exp2nextreg(fs, v);
         funcargs(ls, v);
+        v->u.s.aux = op;  /* lowered when it has one result (see `bitop') */
         break;
       }
       default: return;
@@ -179,6 +179,9 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcstepmul = LUAI_GCMUL;
   g->gcdept = 0;
   for (i=0; i<NUM_TAGS; i++) g->mt[i] = NULL;
+  for (i=0; i<NUM_BITOPS; i++) g->bitopf[i] = NULL;
+  g->tableversion = 0;
+  g->mcacheepoch = 0;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != 0) {
     /* memory allocation error: free partial state */
     close_state(L);
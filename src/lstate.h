@@ -10,6 +10,7 @@
 #include "lua.h"
 
 #include "lobject.h"
+#include "lopcodes.h"
 #include "ltm.h"
 #include "lzio.h"
 
@@ -91,6 +92,9 @@ typedef struct global_State {
   UpVal uvhead;  /* head of double-linked list of all open upvalues */
   struct Table *mt[NUM_TAGS];  /* metatables for basic types */
   TString *tmname[TM_N];  /* array with tag-method names */
+  lua_CFunction bitopf[NUM_BITOPS];  /* built-in functions of the bit ops */
+  unsigned int tableversion;  /* last layout version given to a table */
+  unsigned int mcacheepoch;  /* changes when a table in a cached chain does */
 } global_State;
 
 
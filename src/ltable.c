@@ -63,6 +63,13 @@
 #define hashpointer(t,p)	hashmod(t, IntPoint(p))
 
 
+/*
+** a new layout version invalidates the global caches (see GCache) of `t'
+*/
+#define newversion(L,t) \
+	{ (t)->version = ++G(L)->tableversion; luaH_methodchanged(L, t); }
+
+
 /*
 ** number of ints inside a lua_Number
 */
@@ -291,6 +298,7 @@ static void setnodevector (lua_State *L, Table *t, int size) {
   }
   t->lsizenode = cast_byte(lsize);
   t->lastfree = gnode(t, size);  /* all positions are free */
+  newversion(L, t);
 }
 
 
@@ -359,11 +367,12 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
   Table *t = luaM_new(L, Table);
   luaC_link(L, obj2gco(t), LUA_TTABLE);
   t->metatable = NULL;
-  t->flags = cast_byte(~0);
+  t->flags = cast_byte(~MCACHEBIT);
   /* temporary values (kept only if some malloc fails) */
   t->array = NULL;
   t->sizearray = 0;
   t->lsizenode = 0;
+  t->version = 0;
   t->node = cast(Node *, dummynode);
   setarrayvector(L, t, narray);
   setnodevector(L, t, nhash);
@@ -372,6 +381,7 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
 
 
 void luaH_free (lua_State *L, Table *t) {
+  luaH_methodchanged(L, t);
   if (t->node != dummynode)
     luaM_freearray(L, t->node, sizenode(t), Node);
   luaM_freearray(L, t->array, t->sizearray, TValue);
@@ -422,6 +432,8 @@ static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
       mp = n;
     }
   }
+  if (!ttisnil(gkey(mp)))  /* node held another (moved or dead) key? */
+    newversion(L, t);  /* invalidate caches of its slot */
   gkey(mp)->value = key->value; gkey(mp)->tt = key->tt;
   luaC_barriert(L, t, key);
   lua_assert(ttisnil(gval(mp)));
@@ -450,16 +462,25 @@ const TValue *luaH_getnum (Table *t, int key) {
 
 
 /*
-** search function for strings
+** search function for strings, returning the slot of the key or NULL
 */
-const TValue *luaH_getstr (Table *t, TString *key) {
+Node *luaH_getstrnode (Table *t, TString *key) {
   Node *n = hashstr(t, key);
   do {  /* check whether `key' is somewhere in the chain */
     if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key)
-      return gval(n);  /* that's it */
+      return n;
     else n = gnext(n);
   } while (n);
-  return luaO_nilobject;
+  return NULL;
+}
+
+
+/*
+** search function for strings
+*/
+const TValue *luaH_getstr (Table *t, TString *key) {
+  Node *n = luaH_getstrnode(t, key);
+  return (n != NULL) ? gval(n) : luaO_nilobject;
 }
 
 
@@ -493,6 +514,7 @@ const TValue *luaH_get (Table *t, const TValue *key) {
 
 TValue *luaH_set (lua_State *L, Table *t, const TValue *key) {
   const TValue *p = luaH_get(t, key);
+  luaH_methodchanged(L, t);
   t->flags = 0;
   if (p != luaO_nilobject)
     return cast(TValue *, p);
@@ -18,9 +18,21 @@
 #define key2tval(n)	(&(n)->i_key.tvk)
 
 
+/*
+** bit in `flags' of the tables that method caches depend on (see MCache);
+** changing such a table invalidates all of them
+*/
+#define MCACHEBIT	(1u<<7)
+
+#define luaH_methodchanged(L,t) \
+	{ if ((t)->flags & MCACHEBIT) { \
+	    (t)->flags &= cast_byte(~MCACHEBIT); G(L)->mcacheepoch++; } }
+
+
 LUAI_FUNC const TValue *luaH_getnum (Table *t, int key);
 LUAI_FUNC TValue *luaH_setnum (lua_State *L, Table *t, int key);
 LUAI_FUNC const TValue *luaH_getstr (Table *t, TString *key);
+LUAI_FUNC Node *luaH_getstrnode (Table *t, TString *key);
 LUAI_FUNC TValue *luaH_setstr (lua_State *L, Table *t, TString *key);
 LUAI_FUNC const TValue *luaH_get (Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_set (lua_State *L, Table *t, const TValue *key);
@@ -16,7 +16,19 @@
 
 #include "lauxlib.h"
 #include "lualib.h"
+
+/* eso/eso.lua as bytecode or source, see src/Makefile */
+static const unsigned char eso_lua[] = {
 #include "eso_lua.h"
+};
+
+#if defined(LUA_USE_FORK)
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 
 
@@ -24,6 +36,12 @@ static lua_State *globalL = NULL;
 
 static const char *progname = LUA_PROGNAME;
 
+static const char *esoimage_read = NULL;
+
+static const char *esoimage_write = NULL;
+
+static const char *esostats_write = NULL;
+
 
 
 static void lstop (lua_State *L, lua_Debug *ar) {
@@ -48,6 +66,14 @@ static void print_usage (void) {
   "  -l name  require library " LUA_QL("name") "\n"
   "  -s path  set path to ESOUI source code\n"
   "  -d       show debug output for ESO related features\n"
+  "  -c path  set path for the compiled ESO Lua file cache\n"
+  "  -C       disable the compiled ESO Lua file cache\n"
+  "  -L       load ESOUI library files when their globals are first used\n"
+  "  -f       run the game clock in virtual time, so waiting takes no time\n"
+  "  -w file  write the initialized state to image " LUA_QL("file") "\n"
+  "  -r file  restore the initialized state from image " LUA_QL("file") "\n"
+  "  -t file  write load timings of ESO Lua files to " LUA_QL("file") " as JSON\n"
+  "  --server[=socket]  run scripts sent over stdin or a unix socket\n"
   "  -i       enter interactive mode after executing " LUA_QL("script") "\n"
   "  -v       show version information\n"
   "  --       stop handling options\n"
@@ -140,12 +166,18 @@ static int dofile (lua_State *L, const char *name) {
 }
 
 
-static int dostring (lua_State *L, const char *s, const char *name) {
-  int status = luaL_loadbuffer(L, s, strlen(s), name) || docall(L, 0, 1);
+static int dobuffer (lua_State *L, const char *b, size_t l,
+                     const char *name) {
+  int status = luaL_loadbuffer(L, b, l, name) || docall(L, 0, 1);
   return report(L, status);
 }
 
 
+static int dostring (lua_State *L, const char *s, const char *name) {
+  return dobuffer(L, s, strlen(s), name);
+}
+
+
 static int dolibrary (lua_State *L, const char *name) {
   lua_getglobal(L, "require");
   lua_pushstring(L, name);
@@ -261,13 +293,25 @@ static int handle_script (lua_State *L, char **argv, int n) {
 #define notail(x)	{if ((x)[2] != '\0') return -1;}
 
 
-static int collectargs (char **argv, int *pi, int *pv, int *pe) {
+/* check for `--server' and `--server=socket' */
+static int isserver (const char *arg) {
+  return strncmp(arg, "--server", 8) == 0 && (arg[8] == '\0' || arg[8] == '=');
+}
+
+
+static int collectargs (char **argv, int *pi, int *pv, int *pe,
+                        const char **ps) {
   int i;
   for (i = 1; argv[i] != NULL; i++) {
     if (argv[i][0] != '-')  /* not an option? */
         return i;
     switch (argv[i][1]) {  /* option */
       case '-':
+        if (isserver(argv[i])) {
+          *ps = argv[i] + 8;
+          if (**ps == '=') (*ps)++;
+          break;
+        }
         notail(argv[i]);
         return (argv[i+1] != NULL ? i+1 : 0);
       case '\0':
@@ -280,12 +324,19 @@ static int collectargs (char **argv, int *pi, int *pv, int *pe) {
         *pv = 1;
         break;
       case 'd':
+      case 'C':
+      case 'L':
+      case 'f':
         notail(argv[i]);
         break;
       case 'e':
         *pe = 1;  /* go through */
       case 'l':
       case 's':
+      case 'c':
+      case 'w':
+      case 'r':
+      case 't':
         if (argv[i][2] == '\0') {
           i++;
           if (argv[i] == NULL) return -1;
@@ -336,6 +387,8 @@ static void prepare_esolua_options(lua_State *L, char **argv) {
     if(argv[i][0] != '-') continue;
     switch (argv[i][1]) {  /* option */
       case '-':
+        if (isserver(argv[i])) break;
+        return;
       case '\0':
         return;
       case 's': {
@@ -352,23 +405,214 @@ static void prepare_esolua_options(lua_State *L, char **argv) {
         eso_set_debug_enabled(1);
         break;
       }
+      case 'c': {
+        const char *path = argv[i] + 2;
+        if (*path == '\0') path = argv[++i];
+        lua_assert(path != NULL);
+        eso_set_cache_path(path);
+        break;
+      }
+      case 'C': {
+        eso_set_cache_path(NULL);
+        break;
+      }
+      case 'L': {
+        lua_pushboolean(L, 1);
+        lua_setglobal(L, "ESOUI_LAZY");
+        break;
+      }
+      case 'f': {
+        eso_set_virtual_clock(1);
+        break;
+      }
+      case 'w': {
+        const char *path = argv[i] + 2;
+        if (*path == '\0') path = argv[++i];
+        lua_assert(path != NULL);
+        esoimage_write = path;
+        break;
+      }
+      case 'r': {
+        const char *path = argv[i] + 2;
+        if (*path == '\0') path = argv[++i];
+        lua_assert(path != NULL);
+        esoimage_read = path;
+        break;
+      }
+      case 't': {
+        const char *path = argv[i] + 2;
+        if (*path == '\0') path = argv[++i];
+        lua_assert(path != NULL);
+        esostats_write = path;
+        break;
+      }
       default: break;
     }
   }
 }
 
 
+static int handle_esoluaimage (lua_State *L) {
+  if (eso_load_image(L, esoimage_read) != 0) {
+    fprintf(stderr, "Error restoring image: %s\n", lua_tostring(L, -1));
+    lua_pop(L, 1);
+    return 1;
+  }
+  /* the options are only meant for eso.lua, which did not run */
+  lua_pushnil(L);
+  lua_setglobal(L, "ESOUI_SOURCE_PATH");
+  lua_pushnil(L);
+  lua_setglobal(L, "ESOUI_DEBUG");
+  lua_pushnil(L);
+  lua_setglobal(L, "ESOUI_LAZY");
+  return 0;
+}
+
+
 static int handle_esoluainit (lua_State *L, char **argv)
 {
   prepare_esolua_options(L, argv);
-  int result = dostring(L, (const char *)eso_lua, "@eso.lua");
+  eso_set_image_script(eso_lua, sizeof(eso_lua));
+  if (esoimage_read != NULL && handle_esoluaimage(L) == 0)
+    return 0;  /* otherwise initialize from scratch */
+  if (esoimage_write != NULL)
+    eso_prepare_image(L);
+  int result = dobuffer(L, (const char *)eso_lua, sizeof(eso_lua), "@eso.lua");
   if (result != 0) {
     fprintf(stderr, "Error loading script: %s\n", lua_tostring(L, -1));
   }
+  else if (esoimage_write != NULL && eso_save_image(L, esoimage_write) != 0) {
+    fprintf(stderr, "Error writing image: %s\n", lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
   return result;
 }
 
 
+/*
+** {======================================================
+** Fork server: every request runs in a copy-on-write clone of the
+** initialized state. A request is one line holding either a script
+** path with its arguments or `-e chunk'. Once the request finished,
+** the server answers with a line `#exit status'.
+** =======================================================
+*/
+
+#if defined(LUA_USE_FORK)
+
+#define SERVER_MAXLINE	4096
+#define SERVER_MAXARGS	64
+
+
+static int runrequest (lua_State *L, char *line) {
+  char *argv[SERVER_MAXARGS + 2];
+  int argc = 0;
+  char *token;
+  if (strncmp(line, "-e", 2) == 0)
+    return dostring(L, line + 2 + strspn(line + 2, " \t"), "=(request)");
+  argv[argc++] = (char *)progname;
+  for (token = strtok(line, " \t"); token != NULL && argc <= SERVER_MAXARGS;
+       token = strtok(NULL, " \t"))
+    argv[argc++] = token;
+  argv[argc] = NULL;
+  if (argc < 2) return 0;  /* empty request */
+  return handle_script(L, argv, 1);
+}
+
+
+static int forkrequest (lua_State *L, char *line, int out) {
+  int status;
+  pid_t pid;
+  fflush(stdout);
+  fflush(stderr);
+  pid = fork();
+  if (pid < 0) {
+    l_message(progname, "cannot fork request");
+    return 1;
+  }
+  if (pid == 0) {  /* child: run the request in the cloned state */
+    if (out != STDOUT_FILENO) {
+      dup2(out, STDOUT_FILENO);
+      dup2(out, STDERR_FILENO);
+    }
+    status = runrequest(L, line);
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+  if (waitpid(pid, &status, 0) < 0) return 1;
+  if (WIFEXITED(status)) return WEXITSTATUS(status);
+  return 128 + (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+}
+
+
+static void serverequests (lua_State *L, FILE *in, int out) {
+  char line[SERVER_MAXLINE];
+  char reply[32];
+  while (fgets(line, sizeof(line), in) != NULL) {
+    int status;
+    line[strcspn(line, "\r\n")] = '\0';
+    status = forkrequest(L, line, out);
+    sprintf(reply, "#exit %d\n", status);
+    if (write(out, reply, strlen(reply)) < 0) break;
+  }
+}
+
+
+static int serveonsocket (lua_State *L, const char *path) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+    l_message(progname, "cannot create server socket");
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 16) != 0) {
+    l_message(progname, "cannot listen on server socket");
+    close(fd);
+    return 1;
+  }
+  for (;;) {
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) continue;
+    while (waitpid(-1, NULL, WNOHANG) > 0) ;  /* reap finished clients */
+    if (fork() == 0) {  /* one warm clone per connection */
+      FILE *in = fdopen(client, "r");
+      close(fd);
+      if (in != NULL) serverequests(L, in, client);
+      _exit(EXIT_SUCCESS);
+    }
+    close(client);
+  }
+  return 0;
+}
+
+
+static int handle_server (lua_State *L, const char *path) {
+  lua_gc(L, LUA_GCCOLLECT, 0);  /* share as many pages as possible */
+  if (*path != '\0')
+    return serveonsocket(L, path);
+  serverequests(L, stdin, STDOUT_FILENO);
+  return 0;
+}
+
+#else
+
+static int handle_server (lua_State *L, const char *path) {
+  (void)L; (void)path;
+  l_message(progname, "server mode is not supported on this platform");
+  return 1;
+}
+
+#endif
+
+/* }====================================================== */
+
+
 static int handle_luainit (lua_State *L) {
   const char *init = getenv(LUA_INIT);
   if (init == NULL) return 0;  /* status OK */
@@ -391,6 +635,7 @@ static int pmain (lua_State *L) {
   char **argv = s->argv;
   int script;
   int has_i = 0, has_v = 0, has_e = 0;
+  const char *server = NULL;
   globalL = L;
   if (argv[0] && argv[0][0]) progname = argv[0];
   lua_gc(L, LUA_GCSTOP, 0);  /* stop collector during initialization */
@@ -400,8 +645,8 @@ static int pmain (lua_State *L) {
   if (s->status != 0) return 0;
   s->status = handle_luainit(L);
   if (s->status != 0) return 0;
-  script = collectargs(argv, &has_i, &has_v, &has_e);
-  if (script < 0) {  /* invalid args? */
+  script = collectargs(argv, &has_i, &has_v, &has_e, &server);
+  if (script < 0 || (server != NULL && script > 0)) {  /* invalid args? */
     print_usage();
     s->status = 1;
     return 0;
@@ -409,6 +654,10 @@ static int pmain (lua_State *L) {
   if (has_v) print_version();
   s->status = runargs(L, argv, (script > 0) ? script : s->argc);
   if (s->status != 0) return 0;
+  if (server != NULL) {
+    s->status = handle_server(L, server);
+    return 0;
+  }
   if (script)
     s->status = handle_script(L, argv, script);
   if (s->status != 0) return 0;
@@ -438,6 +687,8 @@ int main (int argc, char **argv) {
   status = lua_cpcall(L, &pmain, &s);
   report(L, status);
   lua_close(L);
+  if (esostats_write != NULL && eso_write_load_stats(esostats_write) != 0)
+    l_message(argv[0], "cannot write load stats");
   return (status || s.status) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
@@ -297,6 +297,13 @@ LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud);
 /* hack */
 LUA_API void lua_setlevel	(lua_State *from, lua_State *to);
 LUA_API void eso_set_debug_enabled(int enable);
+LUA_API void eso_set_cache_path(const char *path);
+LUA_API void eso_set_virtual_clock(int enable);
+LUA_API void eso_set_image_script(const void *data, size_t size);
+LUA_API void eso_prepare_image(lua_State *L);
+LUA_API int eso_save_image(lua_State *L, const char *path);
+LUA_API int eso_load_image(lua_State *L, const char *path);
+LUA_API int eso_write_load_stats(const char *path);
 
 
 /*
@@ -37,6 +37,7 @@
 #define LUA_USE_POSIX
 #define LUA_USE_DLOPEN		/* needs an extra library: -ldl */
 #define LUA_USE_READLINE	/* needs some extra libraries */
+#define LUA_USE_THREADS		/* needs an extra library: -lpthread */
 #endif
 
 #if defined(LUA_USE_MACOSX)
@@ -56,6 +57,18 @@
 #define LUA_USE_ISATTY
 #define LUA_USE_POPEN
 #define LUA_USE_ULONGJMP
+#define LUA_USE_FORK
+#define LUA_USE_MMAP
+#endif
+
+
+/*
+@@ LUA_USE_JUMPTABLE makes the VM dispatch instructions through a table of
+@* label addresses (a GCC and Clang extension) instead of a switch.
+** CHANGE it (define LUA_USE_SWITCH) if you want the portable switch.
+*/
+#if defined(__GNUC__) && !defined(LUA_ANSI) && !defined(LUA_USE_SWITCH)
+#define LUA_USE_JUMPTABLE
 #endif
 
 
@@ -544,6 +557,24 @@
 #endif
 
 
+/*
+@@ The luai_bit* macros define the ESO bit operations over numbers, which
+** truncate both operands to unsigned 64 bit integers. They are shared by
+** the VM and the BitAnd, BitOr, ... functions so both agree bit for bit.
+*/
+#if defined(LUA_CORE) || defined(LUA_LIB)
+#define luai_bitint(a)		((unsigned long long)(a))
+#define luai_bitand(a,b)	((lua_Number)(luai_bitint(a) & luai_bitint(b)))
+#define luai_bitor(a,b)		((lua_Number)(luai_bitint(a) | luai_bitint(b)))
+#define luai_bitxor(a,b)	((lua_Number)(luai_bitint(a) ^ luai_bitint(b)))
+#define luai_bitshl(a,b)	((lua_Number)(luai_bitint(a) << luai_bitint(b)))
+#define luai_bitshr(a,b)	((lua_Number)(luai_bitint(a) >> luai_bitint(b)))
+#define luai_bitnot(a,n)	((lua_Number)(~luai_bitint(a) & \
+				 ((luai_bitint(1) << (n)) - 1)))
+#define LUAI_BITNOTBITS		53
+#endif
+
+
 /*
 @@ lua_number2int is a macro to convert lua_Number to int.
 @@ lua_number2integer is a macro to convert lua_Number to lua_Integer.
@@ -175,6 +175,7 @@ static Proto* LoadFunction(LoadState* S, TString* p)
  LoadConstants(S,f);
  LoadDebug(S,f);
  IF (!luaG_checkcode(f), "bad code");
+ luaF_initcaches(S->L,f);
  S->L->top--;
  S->L->nCcalls--;
  return f;
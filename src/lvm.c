@@ -93,6 +93,93 @@ static void callTMres (lua_State *L, StkId res, const TValue *f,
 
 
 
+/*
+** A global is read from the slot in its GCache while the environment and its
+** layout are the same as when the slot was found. Slots that are nil go the
+** slow way, which honours `__index' and `__newindex' of the environment.
+*/
+#define gcachehit(c,h)	((c)->h == (h) && (c)->version == (h)->version)
+
+
+static void getglobal (lua_State *L, Table *h, TValue *key, StkId val,
+                       GCache *c) {
+  Node *n = luaH_getstrnode(h, rawtsvalue(key));
+  if (n != NULL && !ttisnil(gval(n))) {
+    c->h = h;
+    c->n = n;
+    c->version = h->version;
+    setobj2s(L, val, gval(n));
+  }
+  else {
+    TValue g;
+    sethvalue(L, &g, h);
+    luaV_gettable(L, &g, key, val);
+  }
+}
+
+
+/*
+** A constant key that a table does not have itself is read from the slot in
+** its MCache while the table has the same metatable and no table along the
+** `__index' chain has changed since (see MCACHEBIT in ltable.h).
+*/
+#define getconstkey(rb,rc) { \
+        Table *h = hvalue(rb); \
+        const TValue *res = luaH_getstr(h, rawtsvalue(rc)); \
+        MCache *c = &cl->p->mcache[INDEXK(GETARG_C(i))]; \
+        if (!ttisnil(res) || h->metatable == NULL) { \
+          setobj2s(L, ra, res); \
+        } \
+        else if (c->mt == h->metatable && c->epoch == G(L)->mcacheepoch && \
+                 !ttisnil(gval(c->n))) { \
+          setobj2s(L, ra, gval(c->n)); \
+        } \
+        else \
+          Protect(getmethod(L, rb, rc, ra, c)); \
+      }
+
+
+static void getmethod (lua_State *L, const TValue *t, TValue *key, StkId val,
+                       MCache *c) {
+  /* `t' is a table without `key'; follow its `__index' tables */
+  Table *h = hvalue(t);
+  Table *mt = h->metatable;
+  int loop;
+  for (loop = 0; loop < MAXTAGLOOP; loop++) {
+    const TValue *tm = fasttm(L, h->metatable, TM_INDEX);
+    Node *n;
+    if (tm == NULL || !ttistable(tm))
+      break;  /* not a table chain */
+    h->metatable->flags |= MCACHEBIT;
+    h = hvalue(tm);
+    h->flags |= MCACHEBIT;
+    n = luaH_getstrnode(h, rawtsvalue(key));
+    if (n != NULL && !ttisnil(gval(n))) {
+      c->mt = mt;
+      c->n = n;
+      c->epoch = G(L)->mcacheepoch;
+      setobj2s(L, val, gval(n));
+      return;
+    }
+  }
+  luaV_gettable(L, t, key, val);  /* functions, missing keys and loops */
+}
+
+
+/* calls the function in ra like OP_CALL would when a bit op cannot be done
+   inline, so errors name the global it came from */
+static void callbitop (lua_State *L, StkId ra, const TValue *rb,
+                       const TValue *rc, int nargs) {
+  setobj2s(L, ra+1, rb);
+  if (nargs > 1)
+    setobj2s(L, ra+2, rc);
+  L->top = ra+1+nargs;
+  luaD_call(L, ra, 1);
+  L->top = L->ci->top;
+}
+
+
+
 static void callTM (lua_State *L, const TValue *f, const TValue *p1,
                     const TValue *p2, const TValue *p3) {
   setobj2s(L, L->top, f);  /* push function */
@@ -342,7 +429,7 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 ** some macros for common tasks in `luaV_execute'
 */
 
-#define runtime_check(L, c)	{ if (!(c)) break; }
+#define runtime_check(L, c)	{ if (!(c)) vmbreak; }
 
 #define RA(i)	(base+GETARG_A(i))
 /* to be used after possible stack reallocation */
@@ -355,10 +442,123 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 #define KBx(i)	check_exp(getBMode(GET_OPCODE(i)) == OpArgK, k+GETARG_Bx(i))
 
 
-#define dojump(L,pc,i)	{(pc) += (i); luai_threadyield(L);}
+/*
+** With LUA_USE_JUMPTABLE every instruction jumps straight to the next one
+** through `disp', a table of label addresses (see ljumptab.h). While line or
+** count hooks are set, `disp' is `hooktab', which sends every instruction
+** through the hook first, so the plain dispatch does not test the hook mask.
+** The table is picked again whenever a hook may have been set or removed:
+** after calls and protected code, and on jumps for hooks set by signals.
+** A fused instruction goes on to the second one of its pair with `vmfuse',
+** which jumps to its label directly unless a hook has to see it first.
+*/
+#if defined(LUA_USE_JUMPTABLE)
+
+#define updatedisp(L)	(disp = ((L)->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) \
+				? hooktab : optab)
+
+#define vmfetch()	{ \
+	i = *pc++; \
+	/* warning!! several calls may realloc the stack and invalidate `ra' */ \
+	ra = RA(i); \
+	vmcheck(); }
+
+#define vmdispatch(o)	goto *disp[o];
+#define vmcase(l)	L_##l:
+#define vmbreak		{ vmfetch(); vmdispatch(GET_OPCODE(i)); }
+#define vmfuse(o)	{ vmfetch(); \
+	lua_assert(GET_OPCODE(i) == o); \
+	if (disp == optab) goto L_##o; \
+	vmdispatch(o); }
+
+#else
+
+#define updatedisp(L)	((void)0)
+
+#define vmfetch()	{ \
+	i = *pc++; \
+	if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) && \
+	    (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) { \
+	  traceexec(L, pc); \
+	  if (L->status == LUA_YIELD) {  /* did hook yield? */ \
+	    L->savedpc = pc - 1; \
+	    return; \
+	  } \
+	  base = L->base; \
+	} \
+	/* warning!! several calls may realloc the stack and invalidate `ra' */ \
+	ra = RA(i); \
+	vmcheck(); }
+
+#define vmdispatch(o)	switch (o)
+#define vmcase(l)	case l:
+#define vmbreak		continue
+#define vmfuse(o)	continue
+
+#endif
+
+#define vmcheck() \
+	lua_assert(base == L->base && L->base == L->ci->base); \
+	lua_assert(base <= L->top && L->top <= L->stack + L->stacksize); \
+	lua_assert(L->top == L->ci->top || luaG_checkopenop(i))
+
+
+#define dojump(L,pc,i)	{(pc) += (i); luai_threadyield(L); updatedisp(L);}
+
+
+#define Protect(x)	{ L->savedpc = pc; {x;}; base = L->base; updatedisp(L); }
+
+
+#define isbitopf(L,o,op) (ttisfunction(o) && clvalue(o)->c.isC && \
+        clvalue(o)->c.f == G(L)->bitopf[cast_int(op) - cast_int(OP_BAND)])
 
 
-#define Protect(x)	{ L->savedpc = pc; {x;}; base = L->base; }
+#define bit_op(op,f) { \
+        TValue *rb = RKB(i); \
+        TValue *rc = RKC(i); \
+        if (isbitopf(L, ra, op) && ttisnumber(rb) && ttisnumber(rc)) { \
+          lua_Number nb = nvalue(rb), nc = nvalue(rc); \
+          setnvalue(ra, f(nb, nc)); \
+        } \
+        else \
+          Protect(callbitop(L, ra, rb, rc, 2)); \
+      }
+
+
+#define getglobal_op() { \
+        Table *h = cl->env; \
+        GCache *c = &cl->p->gcache[GETARG_Bx(i)]; \
+        if (gcachehit(c, h) && !ttisnil(gval(c->n))) { \
+          setobj2s(L, ra, gval(c->n)); \
+        } \
+        else { \
+          lua_assert(ttisstring(KBx(i))); \
+          Protect(getglobal(L, h, KBx(i), ra, c)); \
+        } \
+      }
+
+
+#define gettable_op() { \
+        TValue *rb = RB(i); \
+        TValue *rc = RKC(i); \
+        if (ISK(GETARG_C(i)) && ttistable(rb) && ttisstring(rc)) { \
+          getconstkey(rb, rc); \
+        } \
+        else \
+          Protect(luaV_gettable(L, rb, rc, ra)); \
+      }
+
+
+#define self_op() { \
+        StkId rb = RB(i); \
+        TValue *rc = RKC(i); \
+        setobjs2s(L, ra+1, rb); \
+        if (ISK(GETARG_C(i)) && ttistable(rb) && ttisstring(rc)) { \
+          getconstkey(rb, rc); \
+        } \
+        else \
+          Protect(luaV_gettable(L, rb, rc, ra)); \
+      }
 
 
 #define arith_op(op,tm) { \
@@ -379,123 +579,136 @@ void luaV_execute (lua_State *L, int nexeccalls) {
   StkId base;
   TValue *k;
   const Instruction *pc;
+  Instruction i;
+  StkId ra;
+#if defined(LUA_USE_JUMPTABLE)
+#include "ljumptab.h"
+  const void *const *disp;
+#endif
  reentry:  /* entry point */
   lua_assert(isLua(L->ci));
   pc = L->savedpc;
   cl = &clvalue(L->ci->func)->l;
   base = L->base;
   k = cl->p->k;
+  updatedisp(L);
   /* main loop of interpreter */
   for (;;) {
-    const Instruction i = *pc++;
-    StkId ra;
-    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
-        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
-      traceexec(L, pc);
-      if (L->status == LUA_YIELD) {  /* did hook yield? */
-        L->savedpc = pc - 1;
-        return;
+    vmfetch();
+    vmdispatch (GET_OPCODE(i)) {
+#if defined(LUA_USE_JUMPTABLE)
+      vmhook: {  /* every entry of `hooktab' leads here */
+        if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
+            (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
+          traceexec(L, pc);
+          if (L->status == LUA_YIELD) {  /* did hook yield? */
+            L->savedpc = pc - 1;
+            return;
+          }
+          base = L->base;
+          ra = RA(i);
+          updatedisp(L);  /* the hook may have been removed */
+        }
+        goto *optab[GET_OPCODE(i)];
       }
-      base = L->base;
-    }
-    /* warning!! several calls may realloc the stack and invalidate `ra' */
-    ra = RA(i);
-    lua_assert(base == L->base && L->base == L->ci->base);
-    lua_assert(base <= L->top && L->top <= L->stack + L->stacksize);
-    lua_assert(L->top == L->ci->top || luaG_checkopenop(i));
-    switch (GET_OPCODE(i)) {
-      case OP_MOVE: {
+#endif
+      vmcase(OP_MOVE) {
         setobjs2s(L, ra, RB(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADK: {
+      vmcase(OP_LOADK) {
         setobj2s(L, ra, KBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADBOOL: {
+      vmcase(OP_LOADBOOL) {
         setbvalue(ra, GETARG_B(i));
         if (GETARG_C(i)) pc++;  /* skip next instruction (if C) */
-        continue;
+        vmbreak;
       }
-      case OP_LOADNIL: {
+      vmcase(OP_LOADNIL) {
         TValue *rb = RB(i);
         do {
           setnilvalue(rb--);
         } while (rb >= ra);
-        continue;
+        vmbreak;
       }
-      case OP_GETUPVAL: {
+      vmcase(OP_GETUPVAL) {
         int b = GETARG_B(i);
         setobj2s(L, ra, cl->upvals[b]->v);
-        continue;
-      }
-      case OP_GETGLOBAL: {
-        TValue g;
-        TValue *rb = KBx(i);
-        sethvalue(L, &g, cl->env);
-        lua_assert(ttisstring(rb));
-        Protect(luaV_gettable(L, &g, rb, ra));
-        continue;
-      }
-      case OP_GETTABLE: {
-        Protect(luaV_gettable(L, RB(i), RKC(i), ra));
-        continue;
-      }
-      case OP_SETGLOBAL: {
-        TValue g;
-        sethvalue(L, &g, cl->env);
-        lua_assert(ttisstring(KBx(i)));
-        Protect(luaV_settable(L, &g, KBx(i), ra));
-        continue;
-      }
-      case OP_SETUPVAL: {
+        vmbreak;
+      }
+      vmcase(OP_GETGLOBAL) {
+        getglobal_op();
+        vmbreak;
+      }
+      vmcase(OP_GETTABLE) {
+        gettable_op();
+        vmbreak;
+      }
+      vmcase(OP_SETGLOBAL) {
+        Table *h = cl->env;
+        GCache *c = &cl->p->gcache[GETARG_Bx(i)];
+        if (gcachehit(c, h) && !ttisnil(gval(c->n))) {
+          /* an existing global never reaches `__newindex' */
+          setobj2t(L, gval(c->n), ra);
+          luaH_methodchanged(L, h);
+          h->flags = 0;
+          luaC_barriert(L, h, ra);
+        }
+        else {
+          TValue g;
+          sethvalue(L, &g, h);
+          lua_assert(ttisstring(KBx(i)));
+          Protect(luaV_settable(L, &g, KBx(i), ra));
+        }
+        vmbreak;
+      }
+      vmcase(OP_SETUPVAL) {
         UpVal *uv = cl->upvals[GETARG_B(i)];
         setobj(L, uv->v, ra);
         luaC_barrier(L, uv, ra);
-        continue;
+        vmbreak;
       }
-      case OP_SETTABLE: {
+      vmcase(OP_SETTABLE) {
         Protect(luaV_settable(L, ra, RKB(i), RKC(i)));
-        continue;
+        vmbreak;
       }
-      case OP_NEWTABLE: {
+      vmcase(OP_NEWTABLE) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         sethvalue(L, ra, luaH_new(L, luaO_fb2int(b), luaO_fb2int(c)));
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_SELF: {
-        StkId rb = RB(i);
-        setobjs2s(L, ra+1, rb);
-        Protect(luaV_gettable(L, rb, RKC(i), ra));
-        continue;
+      vmcase(OP_SELF) {
+        self_op();
+        vmbreak;
       }
-      case OP_ADD: {
+      vmcase(OP_ADD) {
         arith_op(luai_numadd, TM_ADD);
-        continue;
+        vmbreak;
       }
-      case OP_SUB: {
+      vmcase(OP_SUB) {
         arith_op(luai_numsub, TM_SUB);
-        continue;
+        vmbreak;
       }
-      case OP_MUL: {
+      vmcase(OP_MUL) {
         arith_op(luai_nummul, TM_MUL);
-        continue;
+        vmbreak;
       }
-      case OP_DIV: {
+      vmcase(OP_DIV) {
         arith_op(luai_numdiv, TM_DIV);
-        continue;
+        vmbreak;
       }
-      case OP_MOD: {
+      vmcase(OP_MOD) {
         arith_op(luai_nummod, TM_MOD);
-        continue;
+        vmbreak;
       }
-      case OP_POW: {
+      vmcase(OP_POW) {
         arith_op(luai_numpow, TM_POW);
-        continue;
+        vmbreak;
       }
-      case OP_UNM: {
+      vmcase(OP_UNM) {
         TValue *rb = RB(i);
         if (ttisnumber(rb)) {
           lua_Number nb = nvalue(rb);
@@ -504,14 +717,14 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         else {
           Protect(Arith(L, ra, rb, rb, TM_UNM));
         }
-        continue;
+        vmbreak;
       }
-      case OP_NOT: {
+      vmcase(OP_NOT) {
         int res = l_isfalse(RB(i));  /* next assignment may change this value */
         setbvalue(ra, res);
-        continue;
+        vmbreak;
       }
-      case OP_LEN: {
+      vmcase(OP_LEN) {
         const TValue *rb = RB(i);
         switch (ttype(rb)) {
           case LUA_TTABLE: {
@@ -529,20 +742,20 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             )
           }
         }
-        continue;
+        vmbreak;
       }
-      case OP_CONCAT: {
+      vmcase(OP_CONCAT) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         Protect(luaV_concat(L, c-b+1, c); luaC_checkGC(L));
         setobjs2s(L, RA(i), base+b);
-        continue;
+        vmbreak;
       }
-      case OP_JMP: {
+      vmcase(OP_JMP) {
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_EQ: {
+      vmcase(OP_EQ) {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
         Protect(
@@ -550,40 +763,40 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LT: {
+      vmcase(OP_LT) {
         Protect(
           if (luaV_lessthan(L, RKB(i), RKC(i)) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LE: {
+      vmcase(OP_LE) {
         Protect(
           if (lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TEST: {
+      vmcase(OP_TEST) {
         if (l_isfalse(ra) != GETARG_C(i))
           dojump(L, pc, GETARG_sBx(*pc));
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TESTSET: {
+      vmcase(OP_TESTSET) {
         TValue *rb = RB(i);
         if (l_isfalse(rb) != GETARG_C(i)) {
           setobjs2s(L, ra, rb);
           dojump(L, pc, GETARG_sBx(*pc));
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_CALL: {
+      vmcase(OP_CALL) {
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
@@ -597,14 +810,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             /* it was a C function (`precall' called it); adjust results */
             if (nresults >= 0) L->top = L->ci->top;
             base = L->base;
-            continue;
+            updatedisp(L);
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_TAILCALL: {
+      vmcase(OP_TAILCALL) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         L->savedpc = pc;
@@ -629,14 +843,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           }
           case PCRC: {  /* it was a C function (`precall' called it) */
             base = L->base;
-            continue;
+            updatedisp(L);
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_RETURN: {
+      vmcase(OP_RETURN) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b-1;
         if (L->openupval) luaF_close(L, base);
@@ -651,7 +866,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           goto reentry;
         }
       }
-      case OP_FORLOOP: {
+      vmcase(OP_FORLOOP) {
         lua_Number step = nvalue(ra+2);
         lua_Number idx = luai_numadd(nvalue(ra), step); /* increment index */
         lua_Number limit = nvalue(ra+1);
@@ -661,9 +876,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           setnvalue(ra, idx);  /* update internal index... */
           setnvalue(ra+3, idx);  /* ...and external index */
         }
-        continue;
+        vmbreak;
       }
-      case OP_FORPREP: {
+      vmcase(OP_FORPREP) {
         const TValue *init = ra;
         const TValue *plimit = ra+1;
         const TValue *pstep = ra+2;
@@ -676,9 +891,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           luaG_runerror(L, LUA_QL("for") " step must be a number");
         setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_TFORLOOP: {
+      vmcase(OP_TFORLOOP) {
         StkId cb = ra + 3;  /* call base */
         setobjs2s(L, cb+2, ra+2);
         setobjs2s(L, cb+1, ra+1);
@@ -692,9 +907,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           dojump(L, pc, GETARG_sBx(*pc));  /* jump back */
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_SETLIST: {
+      vmcase(OP_SETLIST) {
         int n = GETARG_B(i);
         int c = GETARG_C(i);
         int last;
@@ -714,13 +929,13 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           setobj2t(L, luaH_setnum(L, h, last--), val);
           luaC_barriert(L, h, val);
         }
-        continue;
+        vmbreak;
       }
-      case OP_CLOSE: {
+      vmcase(OP_CLOSE) {
         luaF_close(L, ra);
-        continue;
+        vmbreak;
       }
-      case OP_CLOSURE: {
+      vmcase(OP_CLOSURE) {
         Proto *p;
         Closure *ncl;
         int nup, j;
@@ -738,9 +953,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         }
         setclvalue(L, ra, ncl);
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_VARARG: {
+      vmcase(OP_VARARG) {
         int b = GETARG_B(i) - 1;
         int j;
         CallInfo *ci = L->ci;
@@ -759,7 +974,53 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             setnilvalue(ra + j);
           }
         }
-        continue;
+        vmbreak;
+      }
+      vmcase(OP_BAND) {
+        bit_op(OP_BAND, luai_bitand);
+        vmbreak;
+      }
+      vmcase(OP_BOR) {
+        bit_op(OP_BOR, luai_bitor);
+        vmbreak;
+      }
+      vmcase(OP_BXOR) {
+        bit_op(OP_BXOR, luai_bitxor);
+        vmbreak;
+      }
+      vmcase(OP_SHL) {
+        bit_op(OP_SHL, luai_bitshl);
+        vmbreak;
+      }
+      vmcase(OP_SHR) {
+        bit_op(OP_SHR, luai_bitshr);
+        vmbreak;
+      }
+      vmcase(OP_BNOT) {
+        TValue *rb = RKB(i);
+        if (isbitopf(L, ra, OP_BNOT) && ttisnumber(rb)) {
+          lua_Number nb = nvalue(rb);
+          setnvalue(ra, luai_bitnot(nb, LUAI_BITNOTBITS));
+        }
+        else
+          Protect(callbitop(L, ra, rb, NULL, 1));
+        vmbreak;
+      }
+      vmcase(OP_GGETTABLE) {
+        getglobal_op();
+        vmfuse(OP_GETTABLE);
+      }
+      vmcase(OP_GGETCALL) {
+        getglobal_op();
+        vmfuse(OP_CALL);
+      }
+      vmcase(OP_SELFCALL) {
+        self_op();
+        vmfuse(OP_CALL);
+      }
+      vmcase(OP_GETTEST) {
+        gettable_op();
+        vmfuse(OP_TEST);
       }
     }
   }
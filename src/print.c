@@ -102,7 +102,7 @@ static void PrintCode(const Proto* f)
     if (o==OP_JMP) printf("%d",sbx); else printf("%d %d",a,sbx);
     break;
   }
-  switch (o)
+  switch (unfused(o))
   {
    case OP_LOADK:
     printf("\t; "); PrintConstant(f,bx);
@@ -128,6 +128,11 @@ static void PrintCode(const Proto* f)
    case OP_EQ:
    case OP_LT:
    case OP_LE:
+   case OP_BAND:
+   case OP_BOR:
+   case OP_BXOR:
+   case OP_SHL:
+   case OP_SHR:
     if (ISK(b) || ISK(c))
     {
      printf("\t; ");
@@ -136,6 +141,9 @@ static void PrintCode(const Proto* f)
      if (ISK(c)) PrintConstant(f,INDEXK(c)); else printf("-");
     }
     break;
+   case OP_BNOT:
+    if (ISK(b)) { printf("\t; "); PrintConstant(f,INDEXK(b)); }
+    break;
    case OP_JMP:
    case OP_FORLOOP:
    case OP_FORPREP: